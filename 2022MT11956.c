@@ -7,40 +7,417 @@
     - Single pipe support (cmd1 | cmd2)
     - Single I/O redirection: <, >, >> (no pipes combined with redirection)
     - Command separators: ; and && (&& executes next only on success)
-    - Wildcard expansion using glob()
-    - Built-ins: cd, history, exit
+    - Background jobs: cmd & (stdin from /dev/null), jobs, jobs --watch [-n secs]
+    - mux line|group [-t] | mux off: background output goes through the shell in
+      whole lines (or whole jobs), optionally tagged "[n] "
+    - Wildcard expansion using glob(), sorted by byte value with a radix sort
+      (MTL458_GLOB_COLLATE=1 restores LC_COLLATE ordering)
+    - zsh-style glob qualifiers: *(.) files, *(/) dirs, *(@) links, *(*) executables,
+      *(Lm+10) size, ^ negates
+    - Brace expansion: {a,b}, {1..N}, {01..10}, {a..e}, {1..N..step} (generated lazily)
+    - Built-ins: cd, history, exit, cat, cp, echo (cat/cp/echo without options run in-shell)
+    - Pipes between builtins (echo, cat, read, history, jobs) run in the shell as
+      coroutines over an in-memory channel; a builtin next to an external command
+      runs in the shell on its end of the kernel pipe
+    - Process substitution: <(list) and >(list) become /dev/fd/N pipes
+    - Shell variables: NAME=value, $NAME, ${NAME}, $?
+    - ( list ) subshells; '( cd dir && cmd )' is a single posix_spawn with a chdir
+      file action, leaving the shell's cwd alone
+    - while cond; do list; done [< in] [> out], also as 'cmd | while ...'
+    - read [-r] [name...]: fields split while the buffered input is scanned
+    - profile on|off|report: samples the shell's own hot paths, folded-stack report
+    - perfstat cmd [| cmd]: perf_event counters for the job, summed over its stages
+    - MTL458_AUDIT_LOG=path: JSON-lines record of every executed command,
+      written by a background thread
+    - Shell file I/O (redirect opens, cat/cp) via io_uring when available,
+      plain syscalls otherwise (MTL458_URING=0 forces the fallback)
+    - mtlsh -c 'list' and mtlsh script: the last command is exec'd in the shell
+      process when no job, profiler, perfstat or audit record is still pending
+    - End of input exits like 'exit'; exit [n] (default: status of the last command)
+    - source script / . script; scripts are compiled to pre-split pieces, cached
+      in $XDG_CACHE_HOME/mtlsh keyed by path, mtime and content hash
+      (MTL458_SCRIPT_CACHE=0 disables the cache)
     - Command history up to 2048 entries (history and history n)
     - Filename auto-completion via Tab (simple)
+    - MTL458_PREFETCH=1: once the first word is typed, a background thread reads
+      its binary and DT_NEEDED libraries into the page cache before Enter
     - Error message on invalid commands: "Invalid Command"
+    - Commands are resolved along PATH before forking; misses are cached (TTL,
+      dropped when PATH or a PATH directory's mtime changes); command -v name
+    - Shared PATH index in the cache directory (per PATH value, seqlock header):
+      lookups and first-word Tab completion read it; only stale dirs are rescanned
+    - sort [-nru] [file...]: in-shell, files mmap'd, parallel merge sort of line
+      records; chunks over MTL458_SORT_MEM (default 1G) spill to sorted temp runs
+    - grep [-Fcvil] string [file...]: in-shell fixed-string search (AVX2/SSE2
+      first/last-byte filter), also as the first or last stage of a pipe
+    - wc -l/-c (SIMD newline count), head -n/-c (stops at the count) and
+      tail -n/-c (reads back from EOF on files) run in-shell
+    - find path... with -name/-iname/-type/-newer/-mindepth/-maxdepth/-print and
+      -exec cmd {} +: threaded getdents64/openat walk, serial-find output order,
+      -exec batches spawned up to one per CPU at a time
+    - du [-ashck] [-d N] path...: work-stealing threaded walk, statx for blocks
+      only, hard links counted once; output as GNU du
   Notes:
     - Does NOT use readline.
     - Designed for POSIX (Linux). Use WSL / Cygwin / Linux VM to run on Windows.
+    - Build: gcc -O2 -pthread 2022MT11956.c -o mtlsh
+      (add -DMTL458_ALLOC_STATS to print malloc/arena counts after every line)
+    - Parse/expansion data lives in a per-line arena; session objects in pools.
 */
 
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <glob.h>
+#include <fnmatch.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <locale.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/perf_event.h>
+#include <time.h>
+#include <pthread.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <ucontext.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <elf.h>
+#include <sys/file.h>
+#include <sched.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define MAXLINE 2048
 #define MAXARGS 100
 #define HISTORY_MAX 2048
 
+/* Tokens that came from a "quoted" string carry this leading byte until
+   expand_wildcards strips it, so quoted text is never brace/glob expanded. */
+#define QUOTED_MARK '\001'
+
+/* ---- Memory: per-line arena and session pools ----
+   Everything built while parsing and expanding one input line (the line itself,
+   pieces, tokens, argv arrays, brace/glob results) is bump-allocated from
+   line_arena and released in one go by arena_reset() before the next prompt, so
+   none of it is freed piecemeal. Fixed-size objects that outlive a line (job
+   entries, cache nodes) come from pools: slabs cut into equal slots, recycled
+   through a free list.
+*/
+#define ARENA_BLOCK (64*1024)
+#define POOL_SLAB 32        // slots per slab
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size, used;
+    char data[];
+};
+
+struct arena {
+    struct arena_block *first, *cur;
+    void *last;             // most recent allocation, the only one that can grow in place
+    unsigned long allocs, bytes;
+};
+
+static struct arena line_arena;
+
+void *arena_alloc(struct arena *a, size_t n) {
+    n = (n + 15) & ~(size_t)15;
+    struct arena_block *b = a->cur;
+    if (!b || b->used + n > b->size) {
+        // blocks past cur never exist (reset frees them), so just chain a new one
+        size_t size = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+        b = malloc(sizeof(struct arena_block) + size);
+        b->size = size;
+        b->used = 0;
+        b->next = NULL;
+        if (a->cur) a->cur->next = b;
+        else a->first = b;
+        a->cur = b;
+    }
+    void *p = b->data + b->used;
+    b->used += n;
+    a->last = p;
+    a->allocs++;
+    a->bytes += n;
+    return p;
+}
+
+/* Grow p (old bytes) to n bytes; in place when p is the newest allocation */
+void *arena_realloc(struct arena *a, void *p, size_t old, size_t n) {
+    if (p && p == a->last) {
+        struct arena_block *b = a->cur;
+        size_t off = (char *)p - b->data;
+        size_t want = (n + 15) & ~(size_t)15;
+        if (off + want <= b->size) {
+            a->bytes += want - (b->used - off);
+            b->used = off + want;
+            return p;
+        }
+    }
+    void *q = arena_alloc(a, n);
+    if (p) memcpy(q, p, old < n ? old : n);
+    return q;
+}
+
+char *arena_copy(struct arena *a, const char *s, size_t len) {
+    char *d = arena_alloc(a, len + 1);
+    memcpy(d, s, len);
+    d[len] = '\0';
+    return d;
+}
+
+char *arena_strndup(struct arena *a, const char *s, size_t n) {
+    return arena_copy(a, s, strnlen(s, n));
+}
+
+char *arena_strdup(struct arena *a, const char *s) {
+    return arena_copy(a, s, strlen(s));
+}
+
+/* Drop everything allocated since the last reset. The first block is kept for the
+   next line; blocks added for an unusually big line are returned to malloc. */
+void arena_reset(struct arena *a) {
+    if (!a->first) return;
+    struct arena_block *b = a->first->next;
+    while (b) {
+        struct arena_block *next = b->next;
+        free(b);
+        b = next;
+    }
+    a->first->next = NULL;
+    a->first->used = 0;
+    a->cur = a->first;
+    a->last = NULL;
+}
+
+/* Position in an arena to roll back to (a loop iteration's allocations) */
+struct arena_mark {
+    struct arena_block *cur;
+    size_t used;
+};
+
+struct arena_mark arena_mark(struct arena *a) {
+    struct arena_mark m = { a->cur, a->cur ? a->cur->used : 0 };
+    return m;
+}
+
+void arena_rewind(struct arena *a, struct arena_mark m) {
+    if (!m.cur) {
+        arena_reset(a);
+        return;
+    }
+    struct arena_block *b = m.cur->next;
+    while (b) {
+        struct arena_block *next = b->next;
+        free(b);
+        b = next;
+    }
+    m.cur->next = NULL;
+    m.cur->used = m.used;
+    a->cur = m.cur;
+    a->last = NULL;
+}
+
+/* Line-lifetime allocation shorthands */
+#define line_alloc(n) arena_alloc(&line_arena, (n))
+#define line_strdup(s) arena_strdup(&line_arena, (s))
+#define line_strndup(s, n) arena_strndup(&line_arena, (s), (n))
+
+struct pool {
+    size_t size;            // slot size
+    void *free_list;
+    unsigned long live, slabs;
+};
+
+#define POOL_INIT(type) { (sizeof(type) + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*), NULL, 0, 0 }
+
+/* Get a zeroed slot, carving a new slab when the free list is empty */
+void *pool_alloc(struct pool *p) {
+    if (!p->free_list) {
+        char *slab = malloc(p->size * POOL_SLAB);
+        for (int i = POOL_SLAB - 1; i >= 0; --i) {
+            void **slot = (void **)(slab + i * p->size);
+            *slot = p->free_list;
+            p->free_list = slot;
+        }
+        p->slabs++;
+    }
+    void **slot = p->free_list;
+    p->free_list = *slot;
+    memset(slot, 0, p->size);
+    p->live++;
+    return slot;
+}
+
+void pool_free(struct pool *p, void *obj) {
+    *(void **)obj = p->free_list;
+    p->free_list = obj;
+    p->live--;
+}
+
+#ifdef MTL458_ALLOC_STATS
+/* Count every heap call made by the shell process, libc internals (glob, stdio) included */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+static unsigned long heap_calls = 0;
+
+void *malloc(size_t n) { __atomic_add_fetch(&heap_calls, 1, __ATOMIC_RELAXED); return __libc_malloc(n); }
+void *calloc(size_t m, size_t n) { __atomic_add_fetch(&heap_calls, 1, __ATOMIC_RELAXED); return __libc_calloc(m, n); }
+void *realloc(void *p, size_t n) { __atomic_add_fetch(&heap_calls, 1, __ATOMIC_RELAXED); return __libc_realloc(p, n); }
+void free(void *p) { __libc_free(p); }
+
+/* Print the counts for the line just executed and start the next one from zero */
+void alloc_stats_line(void) {
+    fprintf(stderr, "[alloc] heap calls: %lu, arena allocs: %lu (%lu bytes)\n",
+            __atomic_exchange_n(&heap_calls, 0, __ATOMIC_RELAXED), line_arena.allocs, line_arena.bytes);
+    line_arena.allocs = line_arena.bytes = 0;
+}
+#endif
+
+/* ---- Sampling profiler: 'profile on|off|report' ----
+   Hot functions open a PROF_FUNC scope, which keeps their name on a small shadow
+   stack for the length of the call. While profiling is on, an ITIMER_PROF timer
+   (the shell's own CPU time) raises SIGPROF and the handler counts the current
+   shadow stack. 'profile report' prints the counts in folded-stack format, ready
+   for flamegraph.pl; CPU used by children comes from RUSAGE_CHILDREN and is
+   reported as separate [children] frames, scaled to the same sample rate.
+*/
+#define PROF_HZ 997
+#define PROF_DEPTH 16
+#define PROF_SLOTS 1024
+
+struct prof_slot {
+    const char *frames[PROF_DEPTH];
+    int depth;
+    unsigned long count;
+};
+
+static const char *prof_stack[PROF_DEPTH];
+static volatile sig_atomic_t prof_depth = 0;
+static volatile sig_atomic_t prof_on = 0;
+static struct prof_slot prof_slots[PROF_SLOTS];
+static unsigned long prof_samples = 0, prof_dropped = 0;
+static struct rusage prof_child_base;
+
+const char *prof_enter(const char *name) {
+    if (prof_depth < PROF_DEPTH) prof_stack[prof_depth] = name;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST); // frame is in place before the handler can see it
+    prof_depth++;
+    return name;
+}
+
+void prof_leave(const char **scope) {
+    (void)scope;
+    prof_depth--;
+}
+
+#define PROF_FUNC \
+    const char *prof_scope_ __attribute__((cleanup(prof_leave), unused)) = prof_enter(__func__)
+
+/* SIGPROF: count the current shadow stack (open addressing on the frame pointers) */
+void prof_sample(int sig) {
+    (void)sig;
+    if (!prof_on) return;
+    int depth = prof_depth < PROF_DEPTH ? prof_depth : PROF_DEPTH;
+    unsigned long h = depth;
+    for (int i = 0; i < depth; ++i) h = h * 31 + (unsigned long)prof_stack[i];
+    for (int probe = 0; probe < PROF_SLOTS; ++probe) {
+        struct prof_slot *sl = &prof_slots[(h + probe) % PROF_SLOTS];
+        if (sl->count == 0) {
+            memcpy(sl->frames, prof_stack, sizeof(char*) * depth);
+            sl->depth = depth;
+        } else if (sl->depth != depth || memcmp(sl->frames, prof_stack, sizeof(char*) * depth) != 0) {
+            continue;
+        }
+        sl->count++;
+        prof_samples++;
+        return;
+    }
+    prof_dropped++;
+}
+
+void prof_start(void) {
+    memset(prof_slots, 0, sizeof(prof_slots));
+    prof_samples = prof_dropped = 0;
+    getrusage(RUSAGE_CHILDREN, &prof_child_base);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = prof_sample;
+    sa.sa_flags = SA_RESTART;   // waitpid()/read() must not see EINTR
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+    struct itimerval it;
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = 1000000 / PROF_HZ;
+    it.it_value = it.it_interval;
+    prof_on = 1;
+    setitimer(ITIMER_PROF, &it, NULL);
+}
+
+void prof_stop(void) {
+    struct itimerval it;
+    memset(&it, 0, sizeof(it));
+    setitimer(ITIMER_PROF, &it, NULL);
+    prof_on = 0;
+}
+
+/* Print samples as "mtlsh;frame;frame count" lines */
+void prof_report(int out_fd) {
+    int was_on = prof_on;
+    prof_on = 0;    // keep the handler off the table while we read it
+    for (int i = 0; i < PROF_SLOTS; ++i) {
+        struct prof_slot *sl = &prof_slots[i];
+        if (sl->count == 0) continue;
+        char line[MAXLINE];
+        int len = snprintf(line, sizeof(line), "mtlsh");
+        for (int k = 0; k < sl->depth && len < (int)sizeof(line); ++k) {
+            len += snprintf(line + len, sizeof(line) - len, ";%s", sl->frames[k]);
+        }
+        dprintf(out_fd, "%s %lu\n", line, sl->count);
+    }
+    struct rusage ru;
+    getrusage(RUSAGE_CHILDREN, &ru);
+    double cu = (ru.ru_utime.tv_sec - prof_child_base.ru_utime.tv_sec) +
+                (ru.ru_utime.tv_usec - prof_child_base.ru_utime.tv_usec) / 1e6;
+    double cs = (ru.ru_stime.tv_sec - prof_child_base.ru_stime.tv_sec) +
+                (ru.ru_stime.tv_usec - prof_child_base.ru_stime.tv_usec) / 1e6;
+    if (cu > 0) dprintf(out_fd, "mtlsh;[children];user %lu\n", (unsigned long)(cu * PROF_HZ + 0.5));
+    if (cs > 0) dprintf(out_fd, "mtlsh;[children];sys %lu\n", (unsigned long)(cs * PROF_HZ + 0.5));
+    fprintf(stderr, "profile: %lu samples at %d Hz\n", prof_samples, PROF_HZ);
+    if (prof_dropped) fprintf(stderr, "profile: %lu samples dropped (table full)\n", prof_dropped);
+    prof_on = was_on;
+}
+
 /* History storage */
 static char *history[HISTORY_MAX];
 static int hist_count = 0;
 
 /* Save command to history (store the raw line) */
 void add_history(const char *line) {
+    PROF_FUNC;
     if (!line || line[0] == '\0') return;
     if (hist_count == HISTORY_MAX) {
         free(history[0]);
@@ -50,19 +427,24 @@ void add_history(const char *line) {
     history[hist_count++] = strdup(line);
 }
 
+struct bstream;
+int bs_write(struct bstream *s, const char *buf, size_t n);
+
 /* Print history: 'history' prints all; 'history n' prints last n (oldest->newest per spec) */
-void do_history(int n) {
+void do_history(int n, struct bstream *out) {
     if (n <= 0 || n > hist_count) {
         // print all
         for (int i = 0; i < hist_count; ++i) {
-            printf("%s\n", history[i]);
+            bs_write(out, history[i], strlen(history[i]));
+            bs_write(out, "\n", 1);
         }
     } else {
         // print last n, but oldest->latest among those
         int start = hist_count - n;
         if (start < 0) start = 0;
         for (int i = start; i < hist_count; ++i) {
-            printf("%s\n", history[i]);
+            bs_write(out, history[i], strlen(history[i]));
+            bs_write(out, "\n", 1);
         }
     }
 }
@@ -78,8 +460,242 @@ char *trim(char *s) {
     return s;
 }
 
-/* Split string into tokens by whitespace respecting quoted strings (double quotes) */
+/* ---- io_uring I/O engine ----
+   The shell's own file I/O (redirect opens, the cat/cp builtins) is queued on a
+   small io_uring so that several operations cost one io_uring_enter. When the
+   kernel has no io_uring (or MTL458_URING=0) the same helpers use plain syscalls.
+*/
+#define URING_ENTRIES 64
+#define COPY_CHUNK (64*1024)
+#define COPY_DEPTH 8    // linked read->write pairs per submission
+
+struct uring {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned queued;
+};
+static struct uring ring;
+static int uring_state = 0; // 0 = not set up yet, 1 = ready, -1 = unavailable
+
+/* Set up the ring on first use. Returns 1 if io_uring can be used. */
+int uring_ready(void) {
+    if (uring_state) return uring_state > 0;
+    uring_state = -1;
+    const char *env = getenv("MTL458_URING");
+    if (env && strcmp(env, "0") == 0) return 0;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0) return 0;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_RW_CUR_POS)) {
+        close(fd);
+        return 0;
+    }
+    size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+    char *rings = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) { close(fd); return 0; }
+    void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) { munmap(rings, sz); close(fd); return 0; }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    ring.fd = fd;
+    ring.sq_tail = (unsigned *)(rings + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(rings + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(rings + p.sq_off.array);
+    ring.cq_head = (unsigned *)(rings + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(rings + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(rings + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+    ring.sqes = sqes;
+    ring.queued = 0;
+    uring_state = 1;
+    return 1;
+}
+
+/* Get a zeroed SQE; user_data is its index within the current batch */
+struct io_uring_sqe *uring_sqe(void) {
+    unsigned idx = (*ring.sq_tail + ring.queued) & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[idx] = idx;
+    sqe->user_data = ring.queued++;
+    return sqe;
+}
+
+/* Submit the queued SQEs, wait for all of them and store each cqe->res in res[user_data].
+   Returns 0, or -1 if the ring itself failed. */
+int uring_run(int *res) {
+    unsigned n = ring.queued;
+    ring.queued = 0;
+    __atomic_store_n(ring.sq_tail, *ring.sq_tail + n, __ATOMIC_RELEASE);
+    unsigned to_submit = n, done = 0;
+    while (done < n) {
+        int r = syscall(__NR_io_uring_enter, ring.fd, to_submit, n - done, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (r < 0 && errno != EINTR) return -1;
+        if (r > 0) to_submit -= r;
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head, ++done) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            res[cqe->user_data] = cqe->res;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+struct open_req {
+    const char *path;
+    int flags;
+    mode_t mode;
+    int fd;     // result: fd, or -errno
+};
+
+/* Open several files in one submission. Returns 0 if all opened;
+   otherwise closes the ones that did open and sets errno from the first failure. */
+int io_open_batch(struct open_req *reqs, int n) {
+    PROF_FUNC;
+    int res[URING_ENTRIES];
+    if (n > 1 && n <= URING_ENTRIES && uring_ready()) {
+        for (int i = 0; i < n; ++i) {
+            struct io_uring_sqe *sqe = uring_sqe();
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (unsigned long)reqs[i].path;
+            sqe->len = reqs[i].mode;
+            sqe->open_flags = reqs[i].flags;
+        }
+        if (uring_run(res) == 0) {
+            for (int i = 0; i < n; ++i) reqs[i].fd = res[i];
+        } else {
+            for (int i = 0; i < n; ++i) reqs[i].fd = -EAGAIN;
+        }
+    } else {
+        for (int i = 0; i < n; ++i) {
+            reqs[i].fd = open(reqs[i].path, reqs[i].flags, reqs[i].mode);
+            if (reqs[i].fd < 0) reqs[i].fd = -errno;
+        }
+    }
+    int err = 0;
+    for (int i = 0; i < n; ++i) {
+        if (reqs[i].fd < 0 && !err) err = -reqs[i].fd;
+    }
+    if (err) {
+        for (int i = 0; i < n; ++i) if (reqs[i].fd >= 0) close(reqs[i].fd);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/* statx() several paths in one submission (flags: 0 or AT_SYMLINK_NOFOLLOW); res[i] is 0 or -errno */
+void io_statx_batch(const char **paths, int n, int flags, unsigned mask, struct statx *out, int *res) {
+    int done = 0;
+    while (done < n && uring_ready()) {
+        int batch = n - done;
+        if (batch > URING_ENTRIES) batch = URING_ENTRIES;
+        for (int i = 0; i < batch; ++i) {
+            struct io_uring_sqe *sqe = uring_sqe();
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (unsigned long)paths[done + i];
+            sqe->len = mask;
+            sqe->statx_flags = flags;
+            sqe->off = (unsigned long)&out[done + i];
+        }
+        if (uring_run(res + done) != 0) break;
+        done += batch;
+    }
+    for (int i = done; i < n; ++i) {
+        res[i] = statx(AT_FDCWD, paths[i], flags, mask, &out[i]) == 0 ? 0 : -errno;
+    }
+}
+
+/* write() all of buf, retrying short writes */
+int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += w; len -= w;
+    }
+    return 0;
+}
+
+/* Copy everything from in to out. A regular-file input is copied with chains of
+   linked read->write SQEs (COPY_DEPTH pairs per io_uring_enter); pipes, terminals
+   or a missing ring use a read/write loop. Returns 0 on success. */
+int io_copy_fd(int in, int out) {
+    PROF_FUNC;
+    static char *bufs;
+    if (!bufs) bufs = malloc(COPY_DEPTH * COPY_CHUNK);
+    struct stat st;
+    off_t off;
+    if (uring_ready() && fstat(in, &st) == 0 && S_ISREG(st.st_mode) &&
+        (off = lseek(in, 0, SEEK_CUR)) >= 0) {
+        int res[2 * COPY_DEPTH];
+        unsigned lens[COPY_DEPTH];
+        while (off < st.st_size) {
+            int pairs = 0;
+            off_t o = off;
+            for (; pairs < COPY_DEPTH && o < st.st_size; ++pairs) {
+                lens[pairs] = (st.st_size - o < COPY_CHUNK) ? st.st_size - o : COPY_CHUNK;
+                char *buf = bufs + (size_t)pairs * COPY_CHUNK;
+                struct io_uring_sqe *rd = uring_sqe();
+                rd->opcode = IORING_OP_READ;
+                rd->fd = in;
+                rd->addr = (unsigned long)buf;
+                rd->len = lens[pairs];
+                rd->off = o;
+                rd->flags = IOSQE_IO_LINK;
+                struct io_uring_sqe *wr = uring_sqe();
+                wr->opcode = IORING_OP_WRITE;
+                wr->fd = out;
+                wr->addr = (unsigned long)buf;
+                wr->len = lens[pairs];
+                wr->off = (__u64)-1;    // current file position, like write()
+                o += lens[pairs];
+                if (pairs + 1 < COPY_DEPTH && o < st.st_size) wr->flags = IOSQE_IO_LINK;
+            }
+            if (uring_run(res) != 0) break;
+            int k = 0;
+            for (; k < pairs; ++k) {
+                if (res[2*k] != (int)lens[k] || res[2*k+1] != (int)lens[k]) break;
+                off += lens[k];
+            }
+            if (k < pairs) {
+                // short read/write broke the chain: finish this file with plain syscalls
+                if (res[2*k+1] > 0) off += res[2*k+1];
+                break;
+            }
+        }
+        lseek(in, off, SEEK_SET);
+    }
+    char *buf = bufs;
+    while (1) {
+        ssize_t r = read(in, buf, COPY_CHUNK);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) return 0;
+        if (write_all(out, buf, r) != 0) return -1;
+    }
+}
+
+/* Split string into tokens by whitespace respecting quoted strings (double quotes).
+   Tokens live in the line arena. */
 int tokenize_args(char *line, char **argv) {
+    PROF_FUNC;
     int argc = 0;
     char *p = line;
     while (*p) {
@@ -90,18 +706,17 @@ int tokenize_args(char *line, char **argv) {
             char *start = p;
             while (*p && *p != '"') p++;
             int len = p - start;
-            argv[argc] = malloc(len + 1);
-            strncpy(argv[argc], start, len);
-            argv[argc][len] = '\0';
+            argv[argc] = line_alloc(len + 2);
+            argv[argc][0] = QUOTED_MARK;
+            strncpy(argv[argc] + 1, start, len);
+            argv[argc][len + 1] = '\0';
             argc++;
             if (*p == '"') p++;
         } else {
             char *start = p;
             while (*p && !isspace((unsigned char)*p)) p++;
             int len = p - start;
-            argv[argc] = malloc(len + 1);
-            strncpy(argv[argc], start, len);
-            argv[argc][len] = '\0';
+            argv[argc] = line_strndup(start, len);
             argc++;
         }
         if (argc >= MAXARGS) break;
@@ -110,141 +725,4935 @@ int tokenize_args(char *line, char **argv) {
     return argc;
 }
 
-/* Free argv allocated by tokenize_args */
-void free_argv(char **argv, int argc) {
-    for (int i = 0; i < argc; ++i) free(argv[i]);
+/* Strip the quote marker left by tokenize_args (if any) */
+const char *unquoted(const char *tok) {
+    return (tok[0] == QUOTED_MARK) ? tok + 1 : tok;
 }
 
-/* Expand wildcards in argv using glob; returns new argv allocated via malloc; new_argc set */
-char **expand_wildcards(char **argv, int argc, int *new_argc) {
-    char **out = malloc(sizeof(char*)*(MAXARGS+1));
-    int outc = 0;
-    for (int i = 0; i < argc; ++i) {
-        if (strchr(argv[i], '*') || strchr(argv[i], '?') || strchr(argv[i], '[')) {
-            glob_t results;
-            int g = glob(argv[i], 0, NULL, &results);
-            if (g == 0) {
-                for (size_t j = 0; j < results.gl_pathc; ++j) {
-                    out[outc++] = strdup(results.gl_pathv[j]);
-                }
-                globfree(&results);
-            } else {
-                // No matches: keep pattern as-is
-                out[outc++] = strdup(argv[i]);
-            }
-        } else {
-            out[outc++] = strdup(argv[i]);
+/* Brace expansion.
+   A word such as "f{a,b}{1..3}" is parsed once into literal and group parts and
+   then stepped like an odometer (rightmost group fastest), yielding one word per
+   call. Ranges are never materialised, so {1..1000000} needs no memory beyond
+   the argv it fills. Alternatives containing braces get a nested generator.
+*/
+enum { BP_LITERAL, BP_LIST, BP_RANGE };
+
+struct brace_gen;
+
+struct brace_part {
+    int kind;
+    char *text;                 // BP_LITERAL
+    char **alts;                // BP_LIST: alternatives
+    struct brace_gen **subs;    // BP_LIST: nested generator per alternative, or NULL
+    int nalts, alt;
+    long from, to, step, cur;   // BP_RANGE
+    int width, is_char;
+};
+
+struct brace_gen {
+    struct brace_part *parts;
+    int nparts, cap;
+    int started;
+    char word[MAXLINE];
+};
+
+struct brace_gen *brace_gen_new(const char *word);
+
+/* Index of the '}' closing the '{' at s[open], or -1 */
+int brace_match(const char *s, int open) {
+    int depth = 0;
+    for (int i = open; s[i]; ++i) {
+        if (s[i] == '{') depth++;
+        else if (s[i] == '}' && --depth == 0) return i;
+    }
+    return -1;
+}
+
+struct brace_part *brace_add_part(struct brace_gen *g, int kind) {
+    if (g->nparts == g->cap) {
+        int old = g->cap;
+        g->cap = g->cap ? g->cap * 2 : 8;
+        g->parts = arena_realloc(&line_arena, g->parts, sizeof(struct brace_part) * old,
+                                 sizeof(struct brace_part) * g->cap);
+    }
+    struct brace_part *bp = &g->parts[g->nparts++];
+    memset(bp, 0, sizeof(*bp));
+    bp->kind = kind;
+    return bp;
+}
+
+/* Parse a whole decimal number; returns 1 on success */
+int parse_long_exact(const char *s, long *out) {
+    if (*s == '\0') return 0;
+    char *end;
+    errno = 0;
+    *out = strtol(s, &end, 10);
+    return (*end == '\0' && errno == 0);
+}
+
+/* Try to parse "X..Y" or "X..Y..S" (numbers or single letters). Returns 1 on success */
+int parse_brace_range(char *body, struct brace_part *bp) {
+    char *a = body;
+    char *dots = strstr(a, "..");
+    if (!dots) return 0;
+    *dots = '\0';
+    char *b = dots + 2;
+    char *s = strstr(b, "..");
+    long step = 1;
+    if (s) {
+        *s = '\0';
+        if (!parse_long_exact(s + 2, &step)) return 0;
+        if (step == 0) step = 1;
+        if (step < 0) step = -step;
+    }
+    if (parse_long_exact(a, &bp->from) && parse_long_exact(b, &bp->to)) {
+        // zero padding when either end is written with a leading zero: {01..10}
+        const char *da = (a[0] == '-') ? a + 1 : a;
+        const char *db = (b[0] == '-') ? b + 1 : b;
+        if ((da[0] == '0' && da[1]) || (db[0] == '0' && db[1])) {
+            int la = strlen(a), lb = strlen(b);
+            bp->width = la > lb ? la : lb;
         }
-        if (outc >= MAXARGS) break;
+    } else if (isalpha((unsigned char)a[0]) && a[1] == '\0' &&
+               isalpha((unsigned char)b[0]) && b[1] == '\0') {
+        bp->from = (unsigned char)a[0];
+        bp->to = (unsigned char)b[0];
+        bp->is_char = 1;
+    } else {
+        return 0;
     }
-    out[outc] = NULL;
-    *new_argc = outc;
-    return out;
+    bp->step = (bp->from <= bp->to) ? step : -step;
+    return 1;
+}
+
+/* Split a {..} body on its top-level commas. Returns 1 if it is a list. */
+int parse_brace_list(char *body, struct brace_part *bp) {
+    int depth = 0, n = 1;
+    for (char *q = body; *q; ++q) {
+        if (*q == '{') depth++;
+        else if (*q == '}') depth--;
+        else if (*q == ',' && depth == 0) n++;
+    }
+    if (n < 2) return 0;
+    bp->alts = line_alloc(sizeof(char*) * n);
+    bp->subs = line_alloc(sizeof(struct brace_gen*) * n);
+    bp->nalts = 0;
+    char *start = body;
+    depth = 0;
+    for (char *q = body; ; ++q) {
+        if (*q == '{') depth++;
+        else if (*q == '}') depth--;
+        else if ((*q == ',' && depth == 0) || *q == '\0') {
+            int last = (*q == '\0');
+            *q = '\0';
+            bp->alts[bp->nalts] = line_strdup(start);
+            bp->subs[bp->nalts] = brace_gen_new(start);
+            bp->nalts++;
+            if (last) break;
+            start = q + 1;
+        }
+    }
+    return 1;
 }
 
-/* Free array returned by expand_wildcards */
-void free_expanded(char **arr, int cnt) {
-    for (int i = 0; i < cnt; ++i) free(arr[i]);
-    free(arr);
+/* Parse word into a generator; returns NULL if the word has no brace group */
+struct brace_gen *brace_gen_new(const char *word) {
+    PROF_FUNC;
+    if (!strchr(word, '{')) return NULL;
+    struct brace_gen *g = line_alloc(sizeof(struct brace_gen));
+    memset(g, 0, sizeof(*g));
+    int groups = 0;
+    int lit_start = 0;
+    int i = 0;
+    while (word[i]) {
+        if (word[i] != '{') { i++; continue; }
+        int close = brace_match(word, i);
+        if (close < 0) break;
+        char *body = line_strndup(word + i + 1, close - i - 1);
+        struct brace_part tmp;
+        memset(&tmp, 0, sizeof(tmp));
+        int kind = BP_LITERAL;
+        if (parse_brace_list(body, &tmp)) {
+            kind = BP_LIST;
+        } else {
+            // parse_brace_range writes into body, so give it its own copy
+            char *rbody = line_strndup(word + i + 1, close - i - 1);
+            if (parse_brace_range(rbody, &tmp)) kind = BP_RANGE;
+        }
+        if (kind == BP_LITERAL) { i++; continue; } // "{x}" is literal; keep scanning inside it
+        if (i > lit_start) {
+            struct brace_part *lp = brace_add_part(g, BP_LITERAL);
+            lp->text = line_strndup(word + lit_start, i - lit_start);
+        }
+        struct brace_part *bp = brace_add_part(g, kind);
+        tmp.kind = kind;
+        *bp = tmp;
+        groups++;
+        i = close + 1;
+        lit_start = i;
+    }
+    if (groups == 0) return NULL;
+    if (word[lit_start]) {
+        struct brace_part *lp = brace_add_part(g, BP_LITERAL);
+        lp->text = line_strdup(word + lit_start);
+    }
+    return g;
 }
 
-/* Execute non-piped command with optional redirection. Returns exit status (0 on success) */
-int execute_command(char **argv, int argc, int redirect_in_fd, int redirect_out_fd, int append_out) {
-    if (argc == 0) return 0;
+int brace_gen_next(struct brace_gen *g);
 
-    // Built-ins: cd, history, exit
-    if (strcmp(argv[0], "cd") == 0) {
-        if (argc < 2) {
-            fprintf(stderr, "Invalid Command\n");
+/* Put a group back on its first value */
+void brace_part_first(struct brace_part *bp) {
+    if (bp->kind == BP_LIST) {
+        bp->alt = 0;
+        if (bp->subs[0]) {
+            bp->subs[0]->started = 0;
+            brace_gen_next(bp->subs[0]);
+        }
+    } else if (bp->kind == BP_RANGE) {
+        bp->cur = bp->from;
+    }
+}
+
+/* Step a group to its next value. Returns 0 (after wrapping to the first value) on carry. */
+int brace_part_advance(struct brace_part *bp) {
+    if (bp->kind == BP_LIST) {
+        if (bp->subs[bp->alt] && brace_gen_next(bp->subs[bp->alt])) return 1;
+        if (++bp->alt < bp->nalts) {
+            if (bp->subs[bp->alt]) {
+                bp->subs[bp->alt]->started = 0;
+                brace_gen_next(bp->subs[bp->alt]);
+            }
             return 1;
         }
-        if (chdir(argv[1]) != 0) {
-            perror("Invalid Command");
+    } else if (bp->kind == BP_RANGE) {
+        long next = bp->cur + bp->step;
+        if (bp->step > 0 ? next <= bp->to : next >= bp->to) {
+            bp->cur = next;
             return 1;
         }
+    } else {
         return 0;
-    } else if (strcmp(argv[0], "history") == 0) {
-        if (argc == 1) {
-            do_history(0);
+    }
+    brace_part_first(bp);
+    return 0;
+}
+
+/* Produce the next word into g->word. Returns 0 once all words were produced. */
+int brace_gen_next(struct brace_gen *g) {
+    if (!g->started) {
+        for (int i = 0; i < g->nparts; ++i) brace_part_first(&g->parts[i]);
+        g->started = 1;
+    } else {
+        int i = g->nparts - 1;
+        while (i >= 0 && !brace_part_advance(&g->parts[i])) i--;
+        if (i < 0) return 0;
+    }
+    size_t len = 0;
+    for (int i = 0; i < g->nparts && len < MAXLINE - 1; ++i) {
+        struct brace_part *bp = &g->parts[i];
+        char num[32];
+        const char *piece = num;
+        if (bp->kind == BP_LITERAL) {
+            piece = bp->text;
+        } else if (bp->kind == BP_LIST) {
+            piece = bp->subs[bp->alt] ? bp->subs[bp->alt]->word : bp->alts[bp->alt];
+        } else if (bp->is_char) {
+            num[0] = (char)bp->cur; num[1] = '\0';
         } else {
-            // parse integer
-            int n = atoi(argv[1]);
-            do_history(n);
+            snprintf(num, sizeof(num), "%0*ld", bp->width, bp->cur);
         }
-        return 0;
-    } else if (strcmp(argv[0], "exit") == 0) {
-        // free history
-        for (int i = 0; i < hist_count; ++i) free(history[i]);
-        exit(0);
+        size_t plen = strlen(piece);
+        if (len + plen > MAXLINE - 1) plen = MAXLINE - 1 - len;
+        memcpy(g->word + len, piece, plen);
+        len += plen;
     }
+    g->word[len] = '\0';
+    return 1;
+}
 
-    pid_t pid = fork();
-    if (pid < 0) {
-        perror("Invalid Command");
-        return 1;
-    } else if (pid == 0) {
-        // child
-        if (redirect_in_fd >= 0) {
-            dup2(redirect_in_fd, STDIN_FILENO);
-            close(redirect_in_fd);
+/* Append a word to a growable argv in the line arena (always keeps room for the NULL terminator) */
+void argv_push(char ***out, int *outc, int *cap, char *word) {
+    if (*outc + 1 >= *cap) {
+        int old = *cap;
+        *cap = *cap ? *cap * 2 : 16;
+        *out = arena_realloc(&line_arena, *out, sizeof(char*) * old, sizeof(char*) * (*cap));
+    }
+    (*out)[(*outc)++] = word;
+}
+
+/* Glob match ordering.
+   glob() sorts with a strcoll-based qsort, which dominates expansion time for
+   very large match sets. By default matches are taken with GLOB_NOSORT, copied
+   into one contiguous arena and put in byte order (same as strcmp) with an MSD
+   radix sort. Setting MTL458_GLOB_COLLATE=1 switches to LC_COLLATE ordering.
+*/
+#define RADIX_CUTOFF 32
+
+static int glob_collate = -1; // -1 = not checked yet
+
+int use_glob_collate(void) {
+    if (glob_collate < 0) {
+        const char *env = getenv("MTL458_GLOB_COLLATE");
+        glob_collate = (env && strcmp(env, "0") != 0);
+        if (glob_collate) setlocale(LC_COLLATE, "");
+    }
+    return glob_collate;
+}
+
+int cmp_strings_coll(const void *a, const void *b) {
+    return strcoll(*(char * const *)a, *(char * const *)b);
+}
+
+/* Sort a[0..n) by bytes from offset depth on; all strings share their first depth bytes */
+void radix_sort_strings(char **a, size_t n, size_t depth, char **tmp) {
+    while (n > 1) {
+        if (n < RADIX_CUTOFF) {
+            for (size_t i = 1; i < n; ++i) {
+                char *v = a[i];
+                size_t j = i;
+                while (j > 0 && strcmp(a[j-1] + depth, v + depth) > 0) {
+                    a[j] = a[j-1];
+                    j--;
+                }
+                a[j] = v;
+            }
+            return;
         }
-        if (redirect_out_fd >= 0) {
-            dup2(redirect_out_fd, STDOUT_FILENO);
-            close(redirect_out_fd);
+        size_t count[256] = {0};
+        for (size_t i = 0; i < n; ++i) count[(unsigned char)a[i][depth]]++;
+        if (count[(unsigned char)a[0][depth]] == n) {
+            // every string has the same byte here: nothing to distribute
+            if (a[0][depth] == '\0') return;
+            depth++;
+            continue;
+        }
+        size_t start[256], pos = 0;
+        for (int b = 0; b < 256; ++b) { start[b] = pos; pos += count[b]; }
+        size_t fill[256];
+        memcpy(fill, start, sizeof(fill));
+        for (size_t i = 0; i < n; ++i) tmp[fill[(unsigned char)a[i][depth]]++] = a[i];
+        memcpy(a, tmp, n * sizeof(char*));
+        // bucket 0 holds strings that ended here; they are all equal
+        for (int b = 1; b < 256; ++b) {
+            if (count[b] > 1) radix_sort_strings(a + start[b], count[b], depth + 1, tmp);
+        }
+        return;
+    }
+}
+
+/* Put matches in the shell's glob order (byte order, or LC_COLLATE when opted in) */
+void sort_matches(char **a, size_t n) {
+    PROF_FUNC;
+    if (n < 2) return;
+    if (use_glob_collate()) {
+        qsort(a, n, sizeof(char*), cmp_strings_coll);
+        return;
+    }
+    char **tmp = line_alloc(n * sizeof(char*));
+    radix_sort_strings(a, n, 0, tmp);
+}
+
+/* glob() pattern and append the matches to out in glob order. Returns the number of
+   matches, or -1 if glob() found none. */
+int glob_push_sorted(const char *pattern, char ***out, int *outc, int *cap) {
+    PROF_FUNC;
+    glob_t results;
+    if (use_glob_collate()) {
+        if (glob(pattern, 0, NULL, &results) != 0) return -1;
+        for (size_t j = 0; j < results.gl_pathc; ++j) {
+            argv_push(out, outc, cap, line_strdup(results.gl_pathv[j]));
         }
-        execvp(argv[0], argv);
-        // If exec fails:
-        fprintf(stderr, "Invalid Command\n");
-        _exit(127);
     } else {
-        int status;
-        waitpid(pid, &status, 0);
-        if (WIFEXITED(status)) return WEXITSTATUS(status);
-        return 1;
+        if (glob(pattern, GLOB_NOSORT, NULL, &results) != 0) return -1;
+        size_t n = results.gl_pathc, total = 0;
+        for (size_t j = 0; j < n; ++j) total += strlen(results.gl_pathv[j]) + 1;
+        // one contiguous run of the line arena holds all the names
+        char *p = line_alloc(total);
+        int first = *outc;
+        for (size_t j = 0; j < n; ++j) {
+            size_t len = strlen(results.gl_pathv[j]) + 1;
+            memcpy(p, results.gl_pathv[j], len);
+            argv_push(out, outc, cap, p);
+            p += len;
+        }
+        sort_matches(*out + first, n);
     }
+    int n = results.gl_pathc;
+    globfree(&results);
+    return n;
 }
 
-/* Execute pipeline of two commands: left | right. Both cmds are argv arrays. */
-int execute_pipe(char **left_argv, int left_argc, char **right_argv, int right_argc) {
-    int pipefd[2];
-    if (pipe(pipefd) == -1) {
-        perror("Invalid Command");
-        return 1;
+/* Glob qualifiers (zsh style): "pattern(quals)" keeps only the matches that fit.
+     .  regular file    /  directory    @  symlink    *  executable regular file
+     L[k|m|g][+|-]n     size in bytes/KiB/MiB/GiB, rounded up: more than (+), less than (-) or exactly n
+     ^                  negates the qualifiers that follow
+   Qualifiers look at the entry itself, not a symlink target. Types come from the
+   directory read's d_type where it is filled in; every other candidate is
+   resolved by a single batched statx once the directory has been read.
+*/
+#define MAXQUALS 16
+enum { Q_REG, Q_DIR, Q_LNK, Q_EXEC, Q_SIZE };
+
+struct glob_qual {
+    int kind, neg;
+    int cmp;                    // Q_SIZE: '+', '-' or '='
+    unsigned long long unit, n;
+};
+
+/* Parse the text between the parentheses; returns the number of qualifiers, or -1 if it is not a qualifier list */
+int parse_glob_quals(const char *q, struct glob_qual *quals) {
+    int n = 0, neg = 0;
+    while (*q) {
+        if (*q == '^') { neg = !neg; q++; continue; }
+        if (n == MAXQUALS) return -1;
+        struct glob_qual *gq = &quals[n];
+        memset(gq, 0, sizeof(*gq));
+        gq->neg = neg;
+        if (*q == '.') gq->kind = Q_REG;
+        else if (*q == '/') gq->kind = Q_DIR;
+        else if (*q == '@') gq->kind = Q_LNK;
+        else if (*q == '*') gq->kind = Q_EXEC;
+        else if (*q == 'L') {
+            gq->kind = Q_SIZE;
+            gq->unit = 1;
+            gq->cmp = '=';
+            q++;
+            if (*q == 'k' || *q == 'K') { gq->unit = 1ULL << 10; q++; }
+            else if (*q == 'm' || *q == 'M') { gq->unit = 1ULL << 20; q++; }
+            else if (*q == 'g' || *q == 'G') { gq->unit = 1ULL << 30; q++; }
+            if (*q == '+' || *q == '-') gq->cmp = *q++;
+            if (!isdigit((unsigned char)*q)) return -1;
+            char *end;
+            gq->n = strtoull(q, &end, 10);
+            q = end;
+            n++;
+            continue;
+        } else return -1;
+        q++;
+        n++;
     }
+    return n > 0 ? n : -1;
+}
 
-    pid_t p1 = fork();
-    if (p1 < 0) {
-        perror("Invalid Command");
-        return 1;
+/* Does an entry with this mode/size satisfy every qualifier? */
+int glob_quals_match(const struct glob_qual *quals, int nq, mode_t mode, unsigned long long size) {
+    for (int i = 0; i < nq; ++i) {
+        const struct glob_qual *gq = &quals[i];
+        int ok = 0;
+        if (gq->kind == Q_REG) ok = S_ISREG(mode);
+        else if (gq->kind == Q_DIR) ok = S_ISDIR(mode);
+        else if (gq->kind == Q_LNK) ok = S_ISLNK(mode);
+        else if (gq->kind == Q_EXEC) ok = S_ISREG(mode) && (mode & 0111);
+        else {
+            unsigned long long units = (size + gq->unit - 1) / gq->unit;
+            if (gq->cmp == '+') ok = units > gq->n;
+            else if (gq->cmp == '-') ok = units < gq->n;
+            else ok = units == gq->n;
+        }
+        if (ok == gq->neg) return 0;
     }
-    if (p1 == 0) {
-        // left child: write end -> stdout
-        dup2(pipefd[1], STDOUT_FILENO);
-        close(pipefd[0]); close(pipefd[1]);
-        execvp(left_argv[0], left_argv);
-        fprintf(stderr, "Invalid Command\n");
-        _exit(127);
+    return 1;
+}
+
+/* File type bits from a dirent d_type (0 if the filesystem did not say) */
+mode_t dtype_to_mode(unsigned char t) {
+    switch (t) {
+    case DT_REG: return S_IFREG;
+    case DT_DIR: return S_IFDIR;
+    case DT_LNK: return S_IFLNK;
+    case DT_FIFO: return S_IFIFO;
+    case DT_SOCK: return S_IFSOCK;
+    case DT_CHR: return S_IFCHR;
+    case DT_BLK: return S_IFBLK;
+    default: return 0;
+    }
+}
+
+int has_glob_chars(const char *s) {
+    return strpbrk(s, "*?[") != NULL;
+}
+
+/* Expand pattern keeping only entries that pass quals; appends them sorted to out
+   and returns how many were added. */
+int expand_qualified_glob(const char *pattern, const struct glob_qual *quals, int nq,
+                          char ***out, int *outc, int *cap) {
+    PROF_FUNC;
+    int need_stat = 0;
+    for (int i = 0; i < nq; ++i) {
+        if (quals[i].kind == Q_EXEC || quals[i].kind == Q_SIZE) need_stat = 1;
+    }
+    char **keep = NULL, **pending = NULL;
+    int nkeep = 0, npend = 0, kcap = 0, pcap = 0;
+
+    const char *slash = strrchr(pattern, '/');
+    const char *base = slash ? slash + 1 : pattern;
+    char *dir = slash ? line_strndup(pattern, (slash == pattern) ? 1 : (size_t)(slash - pattern)) : ".";
+    if (!has_glob_chars(dir) && *base) {
+        // single directory: one readdir pass, d_type decides whatever it can
+        DIR *d = opendir(dir);
+        struct dirent *de;
+        while (d && (de = readdir(d))) {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+            if (fnmatch(base, de->d_name, FNM_PERIOD) != 0) continue;
+            size_t plen = slash ? (size_t)(slash - pattern) + 1 : 0;
+            mode_t mode = dtype_to_mode(de->d_type);
+            if (mode && !need_stat && !glob_quals_match(quals, nq, mode, 0)) continue;
+            char *name = line_alloc(plen + strlen(de->d_name) + 1);
+            memcpy(name, pattern, plen);
+            strcpy(name + plen, de->d_name);
+            if (mode && !need_stat) {
+                argv_push(&keep, &nkeep, &kcap, name);
+            } else {
+                argv_push(&pending, &npend, &pcap, name);
+            }
+        }
+        if (d) closedir(d);
+    } else {
+        glob_t results;
+        if (glob(pattern, GLOB_NOSORT, NULL, &results) == 0) {
+            for (size_t j = 0; j < results.gl_pathc; ++j) {
+                argv_push(&pending, &npend, &pcap, line_strdup(results.gl_pathv[j]));
+            }
+            globfree(&results);
+        }
+    }
+
+    if (npend > 0) {
+        struct statx *sx = line_alloc(sizeof(struct statx) * npend);
+        int *res = line_alloc(sizeof(int) * npend);
+        io_statx_batch((const char **)pending, npend, AT_SYMLINK_NOFOLLOW,
+                       STATX_TYPE | STATX_MODE | STATX_SIZE, sx, res);
+        for (int i = 0; i < npend; ++i) {
+            if (res[i] == 0 && glob_quals_match(quals, nq, sx[i].stx_mode, sx[i].stx_size)) {
+                argv_push(&keep, &nkeep, &kcap, pending[i]);
+            }
+        }
+    }
+
+    sort_matches(keep, nkeep);
+    for (int i = 0; i < nkeep; ++i) argv_push(out, outc, cap, keep[i]);
+    return nkeep;
+}
+
+/* Glob-expand one (unquoted) word into out */
+void expand_glob_word(const char *word, char ***out, int *outc, int *cap) {
+    // "pattern(quals)": filter the matches by glob qualifiers
+    size_t wl = strlen(word);
+    const char *open = (wl > 2 && word[wl-1] == ')') ? strrchr(word, '(') : NULL;
+    if (open && open > word) {
+        char *pattern = line_strndup(word, open - word);
+        char *qtext = line_strndup(open + 1, word + wl - 1 - (open + 1));
+        struct glob_qual quals[MAXQUALS];
+        int nq = has_glob_chars(pattern) ? parse_glob_quals(qtext, quals) : -1;
+        int added = (nq > 0) ? expand_qualified_glob(pattern, quals, nq, out, outc, cap) : 0;
+        if (nq > 0) {
+            // No matches: keep the word as-is, like a plain pattern
+            if (added == 0) argv_push(out, outc, cap, line_strdup(word));
+            return;
+        }
+    }
+    if (has_glob_chars(word)) {
+        if (glob_push_sorted(word, out, outc, cap) >= 0) return;
+        // No matches: keep pattern as-is
+    }
+    argv_push(out, outc, cap, line_strdup(word));
+}
+
+/* Expand braces and wildcards in argv; returns new argv in the line arena; new_argc set.
+   Brace words are streamed from their generator straight into the (growable) result. */
+char **expand_wildcards(char **argv, int argc, int *new_argc) {
+    PROF_FUNC;
+    int cap = MAXARGS + 1;
+    char **out = line_alloc(sizeof(char*)*cap);
+    int outc = 0;
+    for (int i = 0; i < argc; ++i) {
+        if (argv[i][0] == QUOTED_MARK) {
+            argv_push(&out, &outc, &cap, argv[i] + 1);
+            continue;
+        }
+        struct brace_gen *bg = brace_gen_new(argv[i]);
+        if (bg) {
+            while (brace_gen_next(bg)) expand_glob_word(bg->word, &out, &outc, &cap);
+        } else {
+            expand_glob_word(argv[i], &out, &outc, &cap);
+        }
+    }
+    out[outc] = NULL;
+    *new_argc = outc;
+    return out;
+}
+
+
+/* ---- perfstat prefix: 'perfstat cmd ...' or 'perfstat a | b' ----
+   Each child is held on a gate pipe right after fork while the parent attaches
+   counters to it (inherit + enable_on_exec), so exactly the exec'd program and
+   its descendants are counted. Counts from all stages of the job are summed and
+   printed on stderr, perf-stat style, once the job has exited.
+*/
+#define PERF_NEVENTS 5
+
+struct perf_event_desc {
+    __u32 type;
+    __u64 config;
+    const char *name;
+};
+
+static const struct perf_event_desc perf_events[PERF_NEVENTS] = {
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task-clock (ns)" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-misses" },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context-switches" },
+};
+
+static int perfstat_active = 0;
+static unsigned long long perf_totals[PERF_NEVENTS];
+static int perf_counted[PERF_NEVENTS];   // stages where the counter could be opened
+
+struct perf_gate {
+    int pipefd[2];
+    int fds[PERF_NEVENTS];
+};
+
+/* Before fork: create the gate (no-op unless perfstat is active) */
+void perf_gate_open(struct perf_gate *g) {
+    g->pipefd[0] = g->pipefd[1] = -1;
+    for (int i = 0; i < PERF_NEVENTS; ++i) g->fds[i] = -1;
+    if (perfstat_active && pipe2(g->pipefd, O_CLOEXEC) != 0) g->pipefd[0] = g->pipefd[1] = -1;
+}
+
+/* In the child: wait until the parent has attached the counters */
+void perf_gate_wait(struct perf_gate *g) {
+    if (g->pipefd[0] < 0) return;
+    char c;
+    close(g->pipefd[1]);
+    while (read(g->pipefd[0], &c, 1) < 0 && errno == EINTR) {}
+    close(g->pipefd[0]);
+}
+
+/* In the parent: open counters on the held child, then let it exec */
+void perf_gate_attach(struct perf_gate *g, pid_t pid) {
+    if (g->pipefd[0] < 0) return;
+    for (int i = 0; i < PERF_NEVENTS; ++i) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_events[i].type;
+        attr.config = perf_events[i].config;
+        attr.disabled = 1;
+        attr.enable_on_exec = 1;
+        attr.inherit = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        g->fds[i] = syscall(__NR_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (g->fds[i] < 0 && errno == EACCES) {
+            // perf_event_paranoid: unprivileged users may only count user space
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            g->fds[i] = syscall(__NR_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        }
+    }
+    close(g->pipefd[0]);
+    if (write(g->pipefd[1], "", 1) < 0) {}
+    close(g->pipefd[1]);
+}
+
+/* In the parent, after the child was reaped: add its counts to the job totals */
+void perf_gate_collect(struct perf_gate *g) {
+    for (int i = 0; i < PERF_NEVENTS; ++i) {
+        if (g->fds[i] < 0) continue;
+        unsigned long long v[3];    // value, time enabled, time running
+        if (read(g->fds[i], v, sizeof(v)) == sizeof(v)) {
+            if (v[2] > 0 && v[2] < v[1]) v[0] = (unsigned long long)((double)v[0] * v[1] / v[2]);
+            perf_totals[i] += v[0];
+            perf_counted[i]++;
+        }
+        close(g->fds[i]);
+        g->fds[i] = -1;
+    }
+}
+
+int process_piece(char *piece);
+int run_while(char *text);
+
+/* Run a piece under counters and print the summary */
+int run_perfstat(char *piece) {
+    memset(perf_totals, 0, sizeof(perf_totals));
+    memset(perf_counted, 0, sizeof(perf_counted));
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    perfstat_active = 1;
+    int status = process_piece(piece);
+    perfstat_active = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    fprintf(stderr, "\n Performance counter stats for '%s':\n\n", piece);
+    for (int i = 0; i < PERF_NEVENTS; ++i) {
+        if (perf_counted[i]) fprintf(stderr, "%20llu      %s\n", perf_totals[i], perf_events[i].name);
+        else fprintf(stderr, "%20s      %s\n", "<not supported>", perf_events[i].name);
+    }
+    fprintf(stderr, "\n%20.6f seconds time elapsed\n\n",
+            (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+    return status;
+}
+
+/* ---- Audit log: MTL458_AUDIT_LOG=path ----
+   Every executed command (each stage of a pipeline) becomes one JSON line: time,
+   cwd, argv, redirect targets, pipeline position, exit status, wall/CPU time and
+   max RSS. The command path only formats the record and pushes it on a
+   single-producer/single-consumer ring; a background thread drains the ring with
+   writev, so log I/O never sits between the user and the next prompt. When the
+   ring is full the record is dropped and counted in the next one. A forked
+   copy of the shell that runs a list starts a writer of its own
+   (audit_after_fork) and stops it before it exits.
+*/
+#define AUDIT_RING 1024
+#define AUDIT_BATCH 64
+
+static char *audit_ring[AUDIT_RING];
+static unsigned audit_head = 0, audit_tail = 0;    // head: producer, tail: writer thread
+static int audit_seq = 0;                          // futex word, bumped on every push
+static int audit_waiting = 0, audit_stop = 0;
+static unsigned long audit_dropped = 0;
+static int audit_fd = -1;
+static pthread_t audit_thread;
+
+/* How the children of the last job ended (filled in by execute_command/execute_pipe) */
+struct stage_result {
+    pid_t pid;
+    int status;             // raw wait status, -1 while a background stage runs
+    struct rusage ru;
+    struct timespec end;
+};
+static struct stage_result job_stages[2];
+static int job_nstages = 0;
+
+/* State captured when a piece starts running */
+struct audit_start {
+    struct timespec real, mono;
+    struct rusage self;
+    char cwd[PATH_MAX];
+};
+
+struct sbuf {
+    char *buf;
+    size_t len, cap;
+};
+
+void sb_put(struct sbuf *sb, const char *s, size_t n) {
+    if (sb->len + n + 1 > sb->cap) {
+        while (sb->len + n + 1 > sb->cap) sb->cap = sb->cap ? sb->cap * 2 : 256;
+        sb->buf = realloc(sb->buf, sb->cap);
+    }
+    memcpy(sb->buf + sb->len, s, n);
+    sb->len += n;
+    sb->buf[sb->len] = '\0';
+}
+
+void sb_printf(struct sbuf *sb, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void sb_printf(struct sbuf *sb, const char *fmt, ...) {
+    char tmp[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    sb_put(sb, tmp, n < (int)sizeof(tmp) ? n : (int)sizeof(tmp) - 1);
+}
+
+/* Append s as a JSON string literal */
+void sb_json_str(struct sbuf *sb, const char *s) {
+    sb_put(sb, "\"", 1);
+    for (; *s; ++s) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') { char e[2] = { '\\', c }; sb_put(sb, e, 2); }
+        else if (c < 0x20) sb_printf(sb, "\\u%04x", c);
+        else sb_put(sb, (const char *)s, 1);
+    }
+    sb_put(sb, "\"", 1);
+}
+
+void *audit_writer(void *arg) {
+    (void)arg;
+    while (1) {
+        unsigned tail = audit_tail;
+        unsigned head = __atomic_load_n(&audit_head, __ATOMIC_ACQUIRE);
+        if (tail != head) {
+            struct iovec iov[AUDIT_BATCH];
+            int n = 0;
+            for (; tail != head && n < AUDIT_BATCH; ++tail, ++n) {
+                iov[n].iov_base = audit_ring[tail % AUDIT_RING];
+                iov[n].iov_len = strlen(iov[n].iov_base);
+            }
+            // O_APPEND: each writev lands as one unit; a short write only loses the tail of the batch
+            if (writev(audit_fd, iov, n) < 0) {}
+            for (int i = 0; i < n; ++i) free(iov[i].iov_base);
+            __atomic_store_n(&audit_tail, tail, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (__atomic_load_n(&audit_stop, __ATOMIC_SEQ_CST)) break;
+        int seq = __atomic_load_n(&audit_seq, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&audit_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&audit_head, __ATOMIC_SEQ_CST) == tail && !audit_stop) {
+            struct timespec ts = { 1, 0 };
+            syscall(SYS_futex, &audit_seq, FUTEX_WAIT_PRIVATE, seq, &ts, NULL, 0);
+        }
+        __atomic_store_n(&audit_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+void audit_wake(void) {
+    __atomic_add_fetch(&audit_seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&audit_waiting, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, &audit_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/* Flush and stop the writer (atexit) */
+void audit_shutdown(void) {
+    if (audit_fd < 0) return;
+    __atomic_store_n(&audit_stop, 1, __ATOMIC_SEQ_CST);
+    audit_wake();
+    pthread_join(audit_thread, NULL);
+    close(audit_fd);
+    audit_fd = -1;
+}
+
+/* Open the log named by MTL458_AUDIT_LOG and start the writer thread */
+void audit_init(void) {
+    const char *path = getenv("MTL458_AUDIT_LOG");
+    if (!path || !*path) return;
+    audit_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (audit_fd < 0) {
+        perror("Invalid Command");
+        return;
+    }
+    if (pthread_create(&audit_thread, NULL, audit_writer, NULL) != 0) {
+        close(audit_fd);
+        audit_fd = -1;
+        return;
+    }
+    atexit(audit_shutdown);
+}
+
+/* In a forked copy of the shell: the writer thread did not survive the fork.
+   Leave the records still queued to the parent and start a writer for ours. */
+void audit_after_fork(void) {
+    if (audit_fd < 0) return;
+    for (; audit_tail != audit_head; ++audit_tail) free(audit_ring[audit_tail % AUDIT_RING]);
+    audit_seq = audit_waiting = audit_stop = 0;
+    audit_dropped = 0;
+    if (pthread_create(&audit_thread, NULL, audit_writer, NULL) != 0) {
+        close(audit_fd);
+        audit_fd = -1;
+    }
+}
+
+void audit_push(char *rec) {
+    unsigned head = audit_head;
+    if (head - __atomic_load_n(&audit_tail, __ATOMIC_ACQUIRE) >= AUDIT_RING) {
+        audit_dropped++;
+        free(rec);
+        return;
+    }
+    audit_ring[head % AUDIT_RING] = rec;
+    __atomic_store_n(&audit_head, head + 1, __ATOMIC_RELEASE);
+    audit_wake();
+}
+
+void audit_begin(struct audit_start *as) {
+    job_nstages = 0;
+    if (audit_fd < 0) return;
+    clock_gettime(CLOCK_REALTIME, &as->real);
+    clock_gettime(CLOCK_MONOTONIC, &as->mono);
+    getrusage(RUSAGE_SELF, &as->self);
+    if (!getcwd(as->cwd, sizeof(as->cwd))) as->cwd[0] = '\0';
+}
+
+double tv_ms(struct timeval tv) {
+    return tv.tv_sec * 1e3 + tv.tv_usec / 1e3;
+}
+
+/* Path behind an open redirect fd, or NULL */
+const char *fd_path(int fd, char *buf, size_t cap) {
+    if (fd < 0) return NULL;
+    char link[64];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t n = readlink(link, buf, cap - 1);
+    if (n < 0) return NULL;
+    buf[n] = '\0';
+    return buf;
+}
+
+/* Queue the record for one command: stage index of length. Stages that forked a
+   child take their status and usage from job_stages; builtins use the shell's own. */
+void audit_command(const struct audit_start *as, char **argv, int in_fd, int out_fd, int append,
+                   int index, int length, int status) {
+    if (audit_fd < 0) return;
+    struct sbuf sb = { NULL, 0, 0 };
+    struct tm tm;
+    gmtime_r(&as->real.tv_sec, &tm);
+    char ts[32];
+    strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+    sb_printf(&sb, "{\"ts\":\"%s.%03ldZ\",\"pid\":%d,\"cwd\":", ts, as->real.tv_nsec / 1000000, (int)getpid());
+    sb_json_str(&sb, as->cwd);
+    sb_put(&sb, ",\"argv\":[", 9);
+    for (int i = 0; argv[i]; ++i) {
+        if (i) sb_put(&sb, ",", 1);
+        sb_json_str(&sb, argv[i]);
+    }
+    sb_put(&sb, "],\"redirects\":{", 15);
+    char pbuf[PATH_MAX];
+    const char *in_path = fd_path(in_fd, pbuf, sizeof(pbuf));
+    int first = 1;
+    if (in_path) {
+        sb_put(&sb, "\"stdin\":", 8);
+        sb_json_str(&sb, in_path);
+        first = 0;
+    }
+    const char *out_path = fd_path(out_fd, pbuf, sizeof(pbuf));
+    if (out_path) {
+        if (!first) sb_put(&sb, ",", 1);
+        sb_put(&sb, append ? "\"stdout_append\":" : "\"stdout\":", append ? 16 : 9);
+        sb_json_str(&sb, out_path);
+    }
+    sb_printf(&sb, "},\"pipeline\":{\"index\":%d,\"length\":%d}", index, length);
+
+    struct timespec end;
+    struct rusage ru;
+    int builtin = (index >= job_nstages || job_stages[index].pid == 0);
+    if (builtin) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        getrusage(RUSAGE_SELF, &ru);
+        ru.ru_utime.tv_sec -= as->self.ru_utime.tv_sec;
+        ru.ru_utime.tv_usec -= as->self.ru_utime.tv_usec;
+        ru.ru_stime.tv_sec -= as->self.ru_stime.tv_sec;
+        ru.ru_stime.tv_usec -= as->self.ru_stime.tv_usec;
+    } else if (job_stages[index].status == -1) {
+        // background launch: the outcome is not known yet
+        sb_printf(&sb, ",\"builtin\":false,\"background\":true,\"child_pid\":%d,\"status\":null}\n",
+                  (int)job_stages[index].pid);
+        audit_push(sb.buf);
+        return;
+    } else {
+        const struct stage_result *sr = &job_stages[index];
+        end = sr->end;
+        ru = sr->ru;
+        if (WIFEXITED(sr->status)) status = WEXITSTATUS(sr->status);
+        else if (WIFSIGNALED(sr->status)) status = 128 + WTERMSIG(sr->status);
+    }
+    double wall = (end.tv_sec - as->mono.tv_sec) * 1e3 + (end.tv_nsec - as->mono.tv_nsec) / 1e6;
+    sb_printf(&sb, ",\"builtin\":%s,\"status\":%d,\"wall_ms\":%.3f,\"user_ms\":%.3f,\"sys_ms\":%.3f,\"max_rss_kb\":%ld",
+              builtin ? "true" : "false", status, wall, tv_ms(ru.ru_utime), tv_ms(ru.ru_stime), ru.ru_maxrss);
+    if (audit_dropped) {
+        sb_printf(&sb, ",\"dropped_before\":%lu", audit_dropped);
+        audit_dropped = 0;
+    }
+    sb_put(&sb, "}\n", 2);
+    audit_push(sb.buf);
+}
+
+/* ---- Builtin streams: fds, in-memory channels and coroutine pipelines ----
+   Builtins that can be a pipeline stage (echo, cat, read, history, jobs) read
+   and write a struct bstream: either an fd or a channel. When both stages of a
+   pipe are such builtins nothing is forked: each stage runs as a coroutine on
+   its own stack and they are joined by a ring channel. The writer reserves
+   space in the ring and the reader peeks at it in place, so data is never
+   copied through the kernel; a full ring switches to the reader, an empty one
+   to the writer (backpressure without threads or locks). Kernel pipes are used
+   only next to an external command.
+*/
+#define CHAN_SIZE (64 * 1024)
+#define CORO_STACK (256 * 1024)
+#define BS_BUF 8192
+
+struct coro;
+
+struct chan {
+    char *buf;
+    size_t head, tail;      // free-running offsets, readable data is [head, tail)
+    int wclosed, rclosed;   // writer finished / reader went away
+    struct coro *writer, *reader;
+};
+
+struct bstream {
+    int fd;                 // used when ch is NULL; fd 1 goes through stdio
+    struct chan *ch;
+    char *obuf;             // output buffer for other fds, from the line arena
+    size_t olen;
+};
+
+struct coro {
+    ucontext_t ctx;
+    char *stack;
+    int done, status;
+    char **argv;
+    int argc;
+    struct bstream in, out;
+    const char *prof_frames[PROF_DEPTH];    // the profiler's shadow stack while switched out
+    int prof_depth;
+};
+
+static struct coro coro_main;           // the shell itself while a pipeline runs
+static struct coro *coro_cur = NULL;
+static struct coro *coro_stages = NULL;
+static int coro_nstages = 0;
+
+int run_stream_builtin(char **argv, int argc, struct bstream *in, struct bstream *out);
+
+void coro_switch(struct coro *to) {
+    struct coro *from = coro_cur;
+    int depth = prof_depth < PROF_DEPTH ? prof_depth : PROF_DEPTH;
+    from->prof_depth = prof_depth;
+    memcpy(from->prof_frames, prof_stack, sizeof(char*) * depth);
+    prof_depth = 0;
+    depth = to->prof_depth < PROF_DEPTH ? to->prof_depth : PROF_DEPTH;
+    memcpy(prof_stack, to->prof_frames, sizeof(char*) * depth);
+    prof_depth = to->prof_depth;
+    coro_cur = to;
+    swapcontext(&from->ctx, &to->ctx);
+}
+
+/* Contiguous free space at the tail of the ring; waits while it is full.
+   Returns 0 once the reader has gone away. */
+size_t chan_reserve(struct chan *ch, char **p) {
+    while (!ch->rclosed && ch->tail - ch->head == CHAN_SIZE) coro_switch(ch->reader);
+    if (ch->rclosed) {
+        errno = EPIPE;
+        return 0;
+    }
+    size_t off = ch->tail % CHAN_SIZE, room = CHAN_SIZE - (ch->tail - ch->head);
+    if (room > CHAN_SIZE - off) room = CHAN_SIZE - off;
+    *p = ch->buf + off;
+    return room;
+}
+
+void chan_commit(struct chan *ch, size_t n) {
+    ch->tail += n;
+}
+
+/* Contiguous readable bytes at the head of the ring; waits while it is empty.
+   Returns 0 at end of input. */
+size_t chan_peek(struct chan *ch, char **p) {
+    while (ch->tail == ch->head && !ch->wclosed) coro_switch(ch->writer);
+    size_t off = ch->head % CHAN_SIZE, n = ch->tail - ch->head;
+    if (n > CHAN_SIZE - off) n = CHAN_SIZE - off;
+    *p = ch->buf + off;
+    return n;
+}
+
+void chan_consume(struct chan *ch, size_t n) {
+    ch->head += n;
+}
+
+int chan_write(struct chan *ch, const char *buf, size_t n) {
+    while (n > 0) {
+        char *p;
+        size_t room = chan_reserve(ch, &p);
+        if (room == 0) return -1;
+        if (room > n) room = n;
+        memcpy(p, buf, room);
+        chan_commit(ch, room);
+        buf += room;
+        n -= room;
+    }
+    return 0;
+}
+
+void bs_flush(struct bstream *s) {
+    if (s->olen > 0) write_all(s->fd, s->obuf, s->olen);
+    s->olen = 0;
+}
+
+int bs_write(struct bstream *s, const char *buf, size_t n) {
+    if (s->ch) return chan_write(s->ch, buf, n);
+    if (s->fd == STDOUT_FILENO) return fwrite(buf, 1, n, stdout) == n ? 0 : -1;
+    if (!s->obuf) s->obuf = line_alloc(BS_BUF);
+    if (s->olen + n > BS_BUF) {
+        bs_flush(s);
+        if (n > BS_BUF) return write_all(s->fd, buf, n);
+    }
+    memcpy(s->obuf + s->olen, buf, n);
+    s->olen += n;
+    return 0;
+}
+
+void bs_printf(struct bstream *s, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void bs_printf(struct bstream *s, const char *fmt, ...) {
+    char tmp[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    if (n < (int)sizeof(tmp)) {
+        bs_write(s, tmp, n);
+        return;
+    }
+    char *big = line_alloc(n + 1);
+    va_start(ap, fmt);
+    vsnprintf(big, n + 1, fmt, ap);
+    va_end(ap);
+    bs_write(s, big, n);
+}
+
+/* Copy everything from in to out, reading in place from channels and straight
+   into a channel's free space from fds */
+int bs_copy(struct bstream *in, struct bstream *out) {
+    char *p;
+    size_t n;
+    if (in->ch) {
+        while ((n = chan_peek(in->ch, &p)) > 0) {
+            if (bs_write(out, p, n) != 0) return -1;
+            chan_consume(in->ch, n);
+        }
+        return 0;
+    }
+    if (!out->ch) {
+        bs_flush(out);
+        if (out->fd == STDOUT_FILENO) fflush(stdout);
+        return io_copy_fd(in->fd, out->fd);
+    }
+    while ((n = chan_reserve(out->ch, &p)) > 0) {
+        ssize_t r = read(in->fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return r < 0 ? -1 : 0;
+        chan_commit(out->ch, r);
+    }
+    return -1;
+}
+
+/* SIGPIPE is held while builtins run in the shell: a reader that went away
+   gives them EPIPE instead of killing the shell */
+void sigpipe_hold(sigset_t *old) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, old);
+}
+
+void sigpipe_release(sigset_t *old) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    fflush(stdout);
+    struct timespec zero = { 0, 0 };
+    while (sigtimedwait(&set, NULL, &zero) > 0) {}   // drop the pending signal
+    pthread_sigmask(SIG_SETMASK, old, NULL);
+}
+
+int run_here(char **argv, int argc, struct bstream *in, struct bstream *out) {
+    sigset_t old;
+    sigpipe_hold(&old);
+    int status = run_stream_builtin(argv, argc, in, out);
+    sigpipe_release(&old);
+    return status;
+}
+
+void coro_entry(void) {
+    struct coro *c = coro_cur;
+    c->status = run_stream_builtin(c->argv, c->argc, &c->in, &c->out);
+    c->done = 1;
+    if (c->out.ch) c->out.ch->wclosed = 1;
+    if (c->in.ch) c->in.ch->rclosed = 1;
+    // continue with a stage still running, downstream first, else the shell
+    int self = c - coro_stages;
+    struct coro *next = &coro_main;
+    for (int i = self + 1; i < coro_nstages && next == &coro_main; ++i) {
+        if (!coro_stages[i].done) next = &coro_stages[i];
+    }
+    for (int i = self - 1; i >= 0 && next == &coro_main; --i) {
+        if (!coro_stages[i].done) next = &coro_stages[i];
+    }
+    coro_switch(next);
+}
+
+/* Run n stream builtins as one pipeline inside the shell; returns the last stage's status */
+int coro_pipeline(char **argvs[], int argcs[], int n) {
+    PROF_FUNC;
+    struct coro *stages = line_alloc(sizeof(struct coro) * n);
+    struct chan *chans = line_alloc(sizeof(struct chan) * n);
+    memset(stages, 0, sizeof(struct coro) * n);
+    memset(chans, 0, sizeof(struct chan) * n);
+    for (int i = 0; i < n; ++i) {
+        struct coro *c = &stages[i];
+        c->argv = argvs[i];
+        c->argc = argcs[i];
+        c->in.fd = STDIN_FILENO;
+        c->out.fd = STDOUT_FILENO;
+        if (i > 0) c->in.ch = &chans[i - 1];
+        if (i < n - 1) {
+            chans[i].buf = line_alloc(CHAN_SIZE);
+            chans[i].writer = c;
+            chans[i].reader = &stages[i + 1];
+            c->out.ch = &chans[i];
+        }
+        // stage samples show up under the pipeline that started them
+        c->prof_depth = prof_depth;
+        memcpy(c->prof_frames, prof_stack, sizeof(prof_stack));
+        c->stack = malloc(CORO_STACK);
+        getcontext(&c->ctx);
+        c->ctx.uc_stack.ss_sp = c->stack;
+        c->ctx.uc_stack.ss_size = CORO_STACK;
+        c->ctx.uc_link = &coro_main.ctx;
+        makecontext(&c->ctx, coro_entry, 0);
+    }
+    coro_stages = stages;
+    coro_nstages = n;
+    coro_cur = &coro_main;
+
+    sigset_t old;
+    sigpipe_hold(&old);
+    coro_switch(&stages[n - 1]);    // the last stage pulls; back here when all are done
+    sigpipe_release(&old);
+
+    coro_cur = NULL;
+    coro_stages = NULL;
+    coro_nstages = 0;
+    for (int i = 0; i < n; ++i) free(stages[i].stack);
+    return stages[n - 1].status;
+}
+
+/* ---- Shell variables: NAME=value, $NAME, ${NAME}, $? ----
+   A piece of the form NAME=value sets a shell variable; $NAME and ${NAME} are
+   replaced in a piece just before it runs (unset names fall back to the
+   environment, then to ""). Values keep their buffer, so a loop assigning the
+   same variable every iteration does not allocate.
+*/
+#define MAX_VARS 128
+#define VAR_NAME_MAX 32
+
+struct shvar {
+    char name[VAR_NAME_MAX];
+    char *val;
+    size_t cap;
+};
+
+static struct shvar shvars[MAX_VARS];
+static int nshvars = 0;
+static int last_status = 0;     // $?
+
+/* Length of the identifier at s ([A-Za-z_][A-Za-z0-9_]*), 0 if none */
+size_t var_name_len(const char *s) {
+    size_t n = 0;
+    if (!isalpha((unsigned char)s[0]) && s[0] != '_') return 0;
+    while (isalnum((unsigned char)s[n]) || s[n] == '_') n++;
+    return n;
+}
+
+struct shvar *var_find(const char *name, size_t len) {
+    for (int i = 0; i < nshvars; ++i) {
+        if (strncmp(shvars[i].name, name, len) == 0 && shvars[i].name[len] == '\0') return &shvars[i];
+    }
+    return NULL;
+}
+
+int var_set(const char *name, size_t len, const char *val, size_t vlen) {
+    struct shvar *v = var_find(name, len);
+    if (!v) {
+        if (nshvars == MAX_VARS || len >= VAR_NAME_MAX) return -1;
+        v = &shvars[nshvars++];
+        memcpy(v->name, name, len);
+        v->name[len] = '\0';
+    }
+    if (vlen + 1 > v->cap) {
+        v->cap = vlen + 1 < 32 ? 32 : (vlen + 1) * 2;
+        free(v->val);
+        v->val = malloc(v->cap);
+    }
+    memcpy(v->val, val, vlen);
+    v->val[vlen] = '\0';
+    return 0;
+}
+
+const char *var_get(const char *name, size_t len) {
+    struct shvar *v = var_find(name, len);
+    if (v) return v->val;
+    char key[VAR_NAME_MAX];
+    if (len >= sizeof(key)) return "";
+    memcpy(key, name, len);
+    key[len] = '\0';
+    const char *env = getenv(key);
+    return env ? env : "";
+}
+
+/* NAME=value or NAME="value" as a whole piece: set it and return 1 */
+int var_assign(char *piece) {
+    size_t n = var_name_len(piece);
+    if (n == 0 || piece[n] != '=') return 0;
+    char *val = piece + n + 1;
+    size_t vlen = strlen(val);
+    if (vlen >= 2 && val[0] == '"' && val[vlen - 1] == '"') {
+        val++;
+        vlen -= 2;
+    } else if (strpbrk(val, " \t")) {
+        return 0;   // 'NAME=x cmd' is not supported; it runs (and fails) as a command
+    }
+    if (var_set(piece, n, val, vlen) != 0) fprintf(stderr, "Invalid Command\n");
+    return 1;
+}
+
+/* Replace $NAME, ${NAME} and $? in s; s itself is returned when it has no '$' */
+char *expand_vars(char *s) {
+    PROF_FUNC;
+    if (!strchr(s, '$')) return s;
+    size_t cap = strlen(s) + 64, len = 0;
+    char *out = line_alloc(cap);
+    char num[16];
+    for (char *p = s; *p; ) {
+        const char *val = NULL;
+        size_t skip = 0, n;
+        if (p[0] == '$' && p[1] == '?') {
+            snprintf(num, sizeof(num), "%d", last_status);
+            val = num;
+            skip = 2;
+        } else if (p[0] == '$' && p[1] == '{') {
+            n = var_name_len(p + 2);
+            if (n && p[2 + n] == '}') {
+                val = var_get(p + 2, n);
+                skip = n + 3;
+            }
+        } else if (p[0] == '$' && (n = var_name_len(p + 1)) > 0) {
+            val = var_get(p + 1, n);
+            skip = n + 1;
+        }
+        size_t add = val ? strlen(val) : 1;
+        if (len + add + 1 > cap) {
+            out = arena_realloc(&line_arena, out, len, (len + add + 1) * 2);
+            cap = (len + add + 1) * 2;
+        }
+        if (val) {
+            memcpy(out + len, val, add);
+            p += skip;
+        } else {
+            out[len] = *p++;
+        }
+        len += add;
+    }
+    out[len] = '\0';
+    return out;
+}
+
+/* ---- Buffered input: one read-ahead buffer per shell input fd ----
+   The command reader and the 'read' builtin take bytes from rd_in, the buffer
+   in front of the shell's current fd 0, filled RD_BUF bytes per read(). A child
+   inherits the fd but not the buffer, so before every fork the unread part of
+   a regular file is handed back with lseek. A pipe cannot be rewound: while a
+   loop body may start a command that reads the same pipe (rb->shared), the
+   pipe is read one byte at a time so nothing meant for the child is taken.
+*/
+#define RD_BUF (64 * 1024)
+
+struct rd_buf {
+    int fd;
+    int seekable;           // -1 until the first fill
+    int shared;
+    struct chan *ch;        // reading a pipeline channel in place instead of fd
+    char *data;             // buf, or the channel's ring
+    size_t pos, len;
+    char buf[RD_BUF];
+};
+
+static struct rd_buf stdin_rd = { .fd = STDIN_FILENO, .seekable = -1, .data = stdin_rd.buf };
+static struct rd_buf *rd_in = &stdin_rd;
+
+/* Refill an empty buffer; returns the bytes now available, 0 at EOF */
+size_t rd_fill(struct rd_buf *rb) {
+    if (rb->ch) {
+        chan_consume(rb->ch, rb->len);
+        rb->pos = 0;
+        rb->len = chan_peek(rb->ch, &rb->data);
+        return rb->len;
+    }
+    if (rb->seekable < 0) {
+        struct stat st;
+        rb->seekable = fstat(rb->fd, &st) == 0 && S_ISREG(st.st_mode);
+    }
+    size_t want = (rb->shared && !rb->seekable) ? 1 : RD_BUF;
+    ssize_t r;
+    do {
+        r = read(rb->fd, rb->buf, want);
+    } while (r < 0 && errno == EINTR);
+    rb->pos = 0;
+    rb->len = r > 0 ? r : 0;
+    return rb->len;
+}
+
+int rd_getc(struct rd_buf *rb) {
+    if (rb->pos == rb->len && rd_fill(rb) == 0) return EOF;
+    return (unsigned char)rb->data[rb->pos++];
+}
+
+void rd_init(struct rd_buf *rb, int fd) {
+    rb->fd = fd;
+    rb->seekable = -1;
+    rb->shared = 0;
+    rb->ch = NULL;
+    rb->data = rb->buf;
+    rb->pos = rb->len = 0;
+}
+
+/* Hand the unread part of a regular file back to fd 0 before a child inherits it */
+void rd_sync(void) {
+    struct rd_buf *rb = rd_in;
+    if (rb->seekable != 1) return;
+    if (rb->pos < rb->len) lseek(rb->fd, -(off_t)(rb->len - rb->pos), SEEK_CUR);
+    rb->pos = rb->len = 0;
+}
+
+/* ---- Output multiplexer: 'mux off|line|group [-t]' ----
+   With mux on, every background job writes its stdout into a pipe of its own
+   instead of the terminal. One thread reads all those pipes through epoll into
+   a ring buffer per job and hands the terminal only whole lines ('line') or a
+   job's whole output once it ends ('group'), each batch in a single writev, so
+   concurrent jobs no longer interleave mid-line. '-t' prefixes every line with
+   the job's "[n] " tag; the tag and the ring are passed to writev as separate
+   iovecs, nothing is copied. Jobs are reported "Done" only after their output
+   has been drained.
+*/
+#define MUX_RING (64 * 1024)
+
+enum { MUX_OFF, MUX_LINE, MUX_GROUP };
+
+struct mux_chan {
+    int rfd, wfd;
+    char *buf;
+    size_t cap;             // power of two; only grows in group mode
+    size_t head, tail;      // free-running offsets, data is [head, tail)
+    size_t scan;            // no '\n' in [head, scan)
+    int mode, tags;         // mux settings when the job started
+    char tag[16];
+    int taglen;
+    int done;               // pipe drained and closed (set by the mux thread)
+};
+
+static int mux_mode = MUX_OFF, mux_tags = 0;
+static int mux_epfd = -1;
+static pthread_t mux_thread;
+static struct pool mux_pool = POOL_INIT(struct mux_chan);
+static struct mux_chan *mux_pending = NULL;    // opened for the job being launched
+
+/* Add the ring bytes [from, to) as one or two iovecs */
+int mux_segs(struct mux_chan *c, size_t from, size_t to, struct iovec *iov) {
+    size_t off = from & (c->cap - 1), len = to - from;
+    iov[0].iov_base = c->buf + off;
+    if (off + len <= c->cap) {
+        iov[0].iov_len = len;
+        return 1;
+    }
+    iov[0].iov_len = c->cap - off;
+    iov[1].iov_base = c->buf;
+    iov[1].iov_len = len - iov[0].iov_len;
+    return 2;
+}
+
+/* Offset of the first (or last) '\n' in [from, to), or (size_t)-1 */
+size_t mux_find(struct mux_chan *c, size_t from, size_t to, int last) {
+    struct iovec seg[2];
+    int n = mux_segs(c, from, to, seg);
+    size_t base = from;
+    if (last) {
+        base += seg[0].iov_len * (n - 1);
+        for (int i = n - 1; i >= 0; --i) {
+            char *p = memrchr(seg[i].iov_base, '\n', seg[i].iov_len);
+            if (p) return base + (p - (char *)seg[i].iov_base);
+            if (i) base -= seg[i - 1].iov_len;
+        }
+        return (size_t)-1;
+    }
+    for (int i = 0; i < n; ++i) {
+        char *p = memchr(seg[i].iov_base, '\n', seg[i].iov_len);
+        if (p) return base + (p - (char *)seg[i].iov_base);
+        base += seg[i].iov_len;
+    }
+    return (size_t)-1;
+}
+
+int writev_all(int fd, struct iovec *iov, int n) {
+    while (n > 0) {
+        ssize_t w = writev(fd, iov, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+/* Write out the complete lines in the ring (everything when 'all' is set) */
+void mux_flush(struct mux_chan *c, int all) {
+    struct iovec iov[IOV_MAX];
+    int n = 0;
+    size_t pos = c->head;
+    if (!c->tags) {
+        // untagged: one span up to the last newline
+        size_t end = all ? c->tail : mux_find(c, c->scan, c->tail, 1);
+        if (end == (size_t)-1 && c->tail - c->head == c->cap) end = c->tail;  // full, no newline
+        else if (end != (size_t)-1 && !all) end++;
+        if (end != (size_t)-1 && end > pos) {
+            n = mux_segs(c, pos, end, iov);
+            pos = end;
+        }
+    } else {
+        while (pos < c->tail) {
+            size_t nl = mux_find(c, pos > c->scan ? pos : c->scan, c->tail, 0);
+            size_t end = nl != (size_t)-1 ? nl + 1 : c->tail;
+            // a partial line goes out only at EOF or when it alone fills the ring
+            if (nl == (size_t)-1 && !all && (pos != c->head || c->tail - c->head < c->cap)) break;
+            if (n + 3 > IOV_MAX) {
+                writev_all(STDOUT_FILENO, iov, n);
+                n = 0;
+            }
+            iov[n].iov_base = c->tag;
+            iov[n++].iov_len = c->taglen;
+            n += mux_segs(c, pos, end, iov + n);
+            pos = end;
+        }
+    }
+    if (n) writev_all(STDOUT_FILENO, iov, n);
+    c->head = pos;
+    c->scan = c->tail;
+}
+
+/* Group mode keeps everything until EOF: double the ring, unwrapping it */
+void mux_grow(struct mux_chan *c) {
+    char *nb = malloc(c->cap * 2);
+    struct iovec seg[2];
+    int n = mux_segs(c, c->head, c->tail, seg);
+    size_t len = 0;
+    for (int i = 0; i < n; ++i) {
+        memcpy(nb + len, seg[i].iov_base, seg[i].iov_len);
+        len += seg[i].iov_len;
+    }
+    free(c->buf);
+    c->buf = nb;
+    c->cap *= 2;
+    c->scan -= c->head;
+    c->head = 0;
+    c->tail = len;
+}
+
+/* Drain one readable pipe; returns 0 at EOF */
+int mux_read(struct mux_chan *c) {
+    while (1) {
+        if (c->tail - c->head == c->cap) {
+            if (c->mode == MUX_GROUP) mux_grow(c);
+            else mux_flush(c, 0);
+        }
+        // read straight into the free part of the ring
+        struct iovec iov[2];
+        int n = mux_segs(c, c->tail, c->head + c->cap, iov);
+        ssize_t r = readv(c->rfd, iov, n);
+        if (r > 0) {
+            c->tail += r;
+            continue;
+        }
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && errno == EAGAIN) {
+            if (c->mode == MUX_LINE) mux_flush(c, 0);
+            return 1;
+        }
+        mux_flush(c, 1);
+        return 0;
+    }
+}
+
+void *mux_loop(void *arg) {
+    (void)arg;
+    struct epoll_event ev[16];
+    while (1) {
+        int n = epoll_wait(mux_epfd, ev, 16, -1);
+        for (int i = 0; i < n; ++i) {
+            struct mux_chan *c = ev[i].data.ptr;
+            if (mux_read(c)) continue;
+            epoll_ctl(mux_epfd, EPOLL_CTL_DEL, c->rfd, NULL);
+            close(c->rfd);
+            __atomic_store_n(&c->done, 1, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+/* Create the pipe for the background job about to be forked (mux_pending) */
+void mux_open(void) {
+    mux_pending = NULL;
+    if (mux_mode == MUX_OFF) return;
+    if (mux_epfd < 0) {
+        mux_epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (mux_epfd < 0) return;
+        if (pthread_create(&mux_thread, NULL, mux_loop, NULL) != 0) {
+            close(mux_epfd);
+            mux_epfd = -1;
+            return;
+        }
+        pthread_detach(mux_thread);
+    }
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) != 0) return;
+    fcntl(p[0], F_SETFL, O_NONBLOCK);
+    struct mux_chan *c = pool_alloc(&mux_pool);
+    c->rfd = p[0];
+    c->wfd = p[1];
+    c->mode = mux_mode;
+    c->tags = mux_tags;
+    c->cap = MUX_RING;
+    c->buf = malloc(c->cap);
+    mux_pending = c;
+}
+
+/* Parent side after the fork: tag the channel and start reading it */
+void mux_start(struct mux_chan *c, int job_id) {
+    close(c->wfd);
+    c->wfd = -1;
+    c->taglen = snprintf(c->tag, sizeof(c->tag), "[%d] ", job_id);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    if (epoll_ctl(mux_epfd, EPOLL_CTL_ADD, c->rfd, &ev) != 0) {
+        close(c->rfd);
+        c->done = 1;
+    }
+}
+
+/* A launch that did not become a job (fork failed, builtin): drop the channel */
+void mux_abandon(void) {
+    if (!mux_pending) return;
+    close(mux_pending->rfd);
+    close(mux_pending->wfd);
+    free(mux_pending->buf);
+    pool_free(&mux_pool, mux_pending);
+    mux_pending = NULL;
+}
+
+int mux_drained(struct mux_chan *c) {
+    return !c || __atomic_load_n(&c->done, __ATOMIC_ACQUIRE);
+}
+
+void mux_release(struct mux_chan *c) {
+    if (!c) return;
+    free(c->buf);
+    pool_free(&mux_pool, c);
+}
+
+/* Built-in mux: mux | mux off | mux line [-t] | mux group [-t] */
+int builtin_mux(char **argv, int argc, int out_fd) {
+    static const char *names[] = { "off", "line", "group" };
+    if (argc == 1) {
+        dprintf(out_fd, "mux %s%s\n", names[mux_mode], mux_tags ? " -t" : "");
+        return 0;
+    }
+    int mode = -1, tags = 0;
+    for (int m = 0; m < 3; ++m) if (strcmp(argv[1], names[m]) == 0) mode = m;
+    if (argc == 3 && strcmp(argv[2], "-t") == 0 && mode != MUX_OFF) tags = 1;
+    else if (argc != 2) mode = -1;
+    if (mode < 0) {
+        fprintf(stderr, "Invalid Command\n");
+        return 1;
+    }
+    mux_mode = mode;
+    mux_tags = tags;
+    return 0;
+}
+
+/* ---- Background jobs: 'cmd &', 'jobs', 'jobs --watch [-n secs]' ----
+   A piece followed by '&' is started without waiting; its stages go into the job
+   table together with a pidfd each. Finished jobs are reaped (and reported)
+   before the next prompt. 'jobs --watch' samples /proc/<pid>/stat and
+   /proc/<pid>/io of every stage and redraws only the rows that changed; it
+   sleeps in poll() on the pidfds and the terminal, so it wakes up as soon as a
+   job exits or 'q' is pressed.
+*/
+#define MAX_JOBS 64
+#define JOB_CMD_MAX 256
+
+struct job_stage_sample {
+    unsigned long long ticks, rchar, wchar;
+};
+
+struct job {
+    int id;
+    int nstages;
+    pid_t pids[2];
+    int pidfds[2];
+    int status[2];          // raw wait status, -1 while running
+    int finished;           // all stages reaped, not reported yet
+    char cmdline[JOB_CMD_MAX];
+    struct job_stage_sample last[2];
+    struct mux_chan *out;   // stdout pipe when mux is on
+};
+
+static struct job *jobs[MAX_JOBS];  // NULL = free slot; nodes come from job_pool
+static struct pool job_pool = POOL_INIT(struct job);
+static int launch_background = 0;   // set while a '&' piece is being started
+static int final_list = 0;      // the list being run is the last one of -c / a script
+static int exec_in_place = 0;   // set while the final piece of that list is being started
+static const char *job_label = NULL;    // the piece as typed, if it was rewritten (<(list))
+static int next_job_id = 1;
+
+/* Register the stages just launched (job_stages) as a job; returns its id */
+int job_add(const char *cmdline) {
+    for (int j = 0; j < MAX_JOBS; ++j) {
+        if (jobs[j]) continue;
+        struct job *jb = jobs[j] = pool_alloc(&job_pool);
+        jb->id = next_job_id++;
+        jb->nstages = job_nstages;
+        snprintf(jb->cmdline, sizeof(jb->cmdline), "%s", job_label ? job_label : cmdline);
+        jb->out = mux_pending;
+        mux_pending = NULL;
+        if (jb->out) mux_start(jb->out, jb->id);
+        for (int k = 0; k < job_nstages; ++k) {
+            jb->pids[k] = job_stages[k].pid;
+            jb->pidfds[k] = syscall(SYS_pidfd_open, job_stages[k].pid, 0);
+            jb->status[k] = -1;
+        }
+        return jb->id;
+    }
+    // table full: the children still run, they just are not tracked
+    if (mux_pending) mux_start(mux_pending, 0);
+    mux_pending = NULL;
+    return 0;
+}
+
+/* Reap stages that have exited (non-blocking); marks fully finished jobs */
+void procsub_reap(void);
+
+void jobs_reap(void) {
+    procsub_reap();
+    for (int j = 0; j < MAX_JOBS; ++j) {
+        struct job *jb = jobs[j];
+        if (!jb || jb->finished) continue;
+        int running = 0;
+        for (int k = 0; k < jb->nstages; ++k) {
+            if (jb->status[k] != -1) continue;
+            int st;
+            if (waitpid(jb->pids[k], &st, WNOHANG) == jb->pids[k]) {
+                jb->status[k] = st;
+                if (jb->pidfds[k] >= 0) close(jb->pidfds[k]);
+                jb->pidfds[k] = -1;
+            } else {
+                running = 1;
+            }
+        }
+        if (!running) jb->finished = 1;
+    }
+}
+
+/* Print "Done" lines for finished jobs and free their slots */
+void jobs_notify(void) {
+    jobs_reap();
+    for (int j = 0; j < MAX_JOBS; ++j) {
+        struct job *jb = jobs[j];
+        if (!jb || !jb->finished || !mux_drained(jb->out)) continue;
+        int st = jb->status[jb->nstages - 1];
+        if (WIFEXITED(st) && WEXITSTATUS(st) == 0) printf("[%d]+  Done\t\t%s\n", jb->id, jb->cmdline);
+        else if (WIFEXITED(st)) printf("[%d]+  Exit %d\t\t%s\n", jb->id, WEXITSTATUS(st), jb->cmdline);
+        else if (WIFSIGNALED(st)) printf("[%d]+  %s\t\t%s\n", jb->id, strsignal(WTERMSIG(st)), jb->cmdline);
+        else printf("[%d]+  Done\t\t%s\n", jb->id, jb->cmdline);
+        mux_release(jb->out);
+        pool_free(&job_pool, jb);
+        jobs[j] = NULL;
+    }
+    fflush(stdout);
+}
+
+/* Read CPU ticks, RSS (KiB) and I/O counters of a running child from /proc */
+int proc_sample(pid_t pid, struct job_stage_sample *smp, long *rss_kb) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+    char *p = strrchr(buf, ')');   // comm may contain spaces
+    if (!p) return -1;
+    unsigned long utime = 0, stime = 0;
+    long rss = 0;
+    // fields after ')': state(3) ... utime(14) stime(15) ... rss(24)
+    if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %*d %*d %*d %*d %*u %*u %ld",
+               &utime, &stime, &rss) != 3) return -1;
+    smp->ticks = utime + stime;
+    *rss_kb = rss * (sysconf(_SC_PAGESIZE) / 1024);
+    smp->rchar = smp->wchar = 0;
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (n > 0) {
+            buf[n] = '\0';
+            sscanf(buf, "rchar: %llu wchar: %llu", &smp->rchar, &smp->wchar);
+        }
+    }
+    return 0;
+}
+
+/* Human-readable byte count into buf */
+const char *fmt_bytes(double v, char *buf, size_t cap) {
+    const char *units = "BKMGT";
+    int u = 0;
+    while (v >= 1024 && u < 4) { v /= 1024; u++; }
+    snprintf(buf, cap, u ? "%.1f%c" : "%.0f%c", v, units[u]);
+    return buf;
+}
+
+void jobs_list(struct bstream *out) {
+    jobs_reap();
+    for (int j = 0; j < MAX_JOBS; ++j) {
+        struct job *jb = jobs[j];
+        if (!jb) continue;
+        bs_printf(out, "[%d]  %s\t\t%s &\n", jb->id, jb->finished ? "Done" : "Running", jb->cmdline);
+    }
+}
+
+/* Build one frame of the watch table; returns the number of lines */
+int jobs_watch_frame(char lines[][256], int maxlines, double dt) {
+    static long clk_tck = 0;
+    if (!clk_tck) clk_tck = sysconf(_SC_CLK_TCK);
+    int n = 0;
+    snprintf(lines[n++], 256, "%-5s %-7s %6s %8s %9s %9s %9s %9s  %s",
+             "JOB", "PID", "CPU%", "RSS", "READ", "WRITTEN", "R/s", "W/s", "COMMAND");
+    for (int j = 0; j < MAX_JOBS && n < maxlines; ++j) {
+        struct job *jb = jobs[j];
+        if (!jb) continue;
+        for (int k = 0; k < jb->nstages && n < maxlines; ++k) {
+            char tag[16];
+            snprintf(tag, sizeof(tag), k ? " |%d" : "[%d]", k ? k : jb->id);
+            struct job_stage_sample smp;
+            long rss;
+            if (jb->status[k] != -1 || proc_sample(jb->pids[k], &smp, &rss) != 0) {
+                snprintf(lines[n++], 256, "%-5s %-7d %6s %8s %9s %9s %9s %9s  %s", tag, (int)jb->pids[k],
+                         "-", "-", "-", "-", "-", "-", jb->status[k] != -1 ? "(done)" : "(gone)");
+                continue;
+            }
+            struct job_stage_sample *prev = &jb->last[k];
+            double cpu = 0, rps = 0, wps = 0;
+            if (dt > 0 && prev->ticks + prev->rchar + prev->wchar > 0) {
+                cpu = 100.0 * (smp.ticks - prev->ticks) / clk_tck / dt;
+                rps = (smp.rchar - prev->rchar) / dt;
+                wps = (smp.wchar - prev->wchar) / dt;
+            }
+            *prev = smp;
+            char b1[16], b2[16], b3[16], b4[16], b5[16];
+            int w = snprintf(lines[n], 256, "%-5s %-7d %6.1f %8s %9s %9s %9s %9s  ", tag, (int)jb->pids[k], cpu,
+                     fmt_bytes(rss * 1024.0, b1, sizeof(b1)), fmt_bytes(smp.rchar, b2, sizeof(b2)),
+                     fmt_bytes(smp.wchar, b3, sizeof(b3)), fmt_bytes(rps, b4, sizeof(b4)),
+                     fmt_bytes(wps, b5, sizeof(b5)));
+            // the command column is cut at the line width
+            if (k == 0 && w > 0 && w < 255) {
+                size_t len = strlen(jb->cmdline);
+                if (len > (size_t)(255 - w)) len = 255 - w;
+                memcpy(lines[n] + w, jb->cmdline, len);
+                lines[n][w + len] = '\0';
+            }
+            n++;
+        }
+    }
+    return n;
+}
+
+/* 'jobs --watch': live table until 'q' or until no job is left */
+void jobs_watch(double interval, int out_fd) {
+    enum { WATCH_LINES = 64 };
+    static char prev[WATCH_LINES][256], cur[WATCH_LINES][256];
+    int prev_n = 0;
+    struct termios orig_tio, raw_tio;
+    int tty = (tcgetattr(STDIN_FILENO, &orig_tio) == 0);
+    if (tty) {
+        raw_tio = orig_tio;
+        raw_tio.c_lflag &= ~(ICANON | ECHO);
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw_tio);
+    }
+    struct timespec last, now;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    double dt = 0;
+    dprintf(out_fd, "\033[?25l");     // hide cursor while redrawing
+    while (1) {
+        jobs_reap();
+        int n = jobs_watch_frame(cur, WATCH_LINES, dt);
+        // redraw: go back to the first row, rewrite only rows that changed
+        struct sbuf sb = { NULL, 0, 0 };
+        if (prev_n > 0) sb_printf(&sb, "\033[%dA", prev_n);
+        for (int i = 0; i < n; ++i) {
+            if (i < prev_n && strcmp(prev[i], cur[i]) == 0) {
+                sb_put(&sb, "\033[1B", 4);
+            } else {
+                sb_put(&sb, "\r", 1);
+                sb_put(&sb, cur[i], strlen(cur[i]));
+                sb_put(&sb, "\033[K\n", 4);
+            }
+            memcpy(prev[i], cur[i], 256);
+        }
+        if (n < prev_n) sb_put(&sb, "\033[J", 3);
+        prev_n = n;
+        if (sb.len) write_all(out_fd, sb.buf, sb.len);
+        free(sb.buf);
+
+        int running = 0;
+        struct pollfd pfds[1 + 2 * MAX_JOBS];
+        int np = 0;
+        pfds[np].fd = tty ? STDIN_FILENO : -1;
+        pfds[np++].events = POLLIN;
+        for (int j = 0; j < MAX_JOBS; ++j) {
+            struct job *jb = jobs[j];
+            if (!jb || jb->finished) continue;
+            running = 1;
+            for (int k = 0; k < jb->nstages; ++k) {
+                if (jb->pidfds[k] < 0) continue;
+                pfds[np].fd = jb->pidfds[k];
+                pfds[np++].events = POLLIN;
+            }
+        }
+        if (!running) break;
+        if (poll(pfds, np, (int)(interval * 1000)) > 0 && (pfds[0].revents & POLLIN)) {
+            char c;
+            if (read(STDIN_FILENO, &c, 1) == 1 && (c == 'q' || c == 'Q' || c == 3)) break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        dt = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+        last = now;
+    }
+    dprintf(out_fd, "\033[?25h");
+    if (tty) tcsetattr(STDIN_FILENO, TCSANOW, &orig_tio);
+}
+
+/* Built-in jobs: jobs | jobs --watch [-n secs] */
+int builtin_jobs(char **argv, int argc, int out_fd) {
+    if (argc == 1) {
+        struct bstream out = { out_fd, NULL, NULL, 0 };
+        jobs_list(&out);
+        bs_flush(&out);
+        return 0;
+    }
+    if (strcmp(argv[1], "--watch") == 0) {
+        double interval = 1.0;
+        if (argc == 4 && strcmp(argv[2], "-n") == 0) interval = atof(argv[3]);
+        else if (argc != 2) {
+            fprintf(stderr, "Invalid Command\n");
+            return 1;
+        }
+        if (interval < 0.05) interval = 0.05;
+        jobs_watch(interval, out_fd);
+        return 0;
+    }
+    fprintf(stderr, "Invalid Command\n");
+    return 1;
+}
+
+/* Built-in echo (no options): the words separated by one blank, then a newline */
+int builtin_echo(char **argv, int argc, struct bstream *out) {
+    size_t len = 0;
+    for (int i = 1; i < argc; ++i) len += strlen(argv[i]) + 1;
+    char *buf = line_alloc(len + 1), *p = buf;
+    for (int i = 1; i < argc; ++i) {
+        if (i > 1) *p++ = ' ';
+        p = stpcpy(p, argv[i]);
+    }
+    *p++ = '\n';
+    return bs_write(out, buf, p - buf) == 0 ? 0 : 1;
+}
+
+/* Built-in read: read [-r] [name...]. One pass over the buffered input finds the
+   end of the line and splits it into blank-separated fields; the last name gets
+   the rest of the line, REPLY is set when no name is given. Without -r a
+   backslash quotes the next character and backslash-newline continues the line.
+   Returns 1 at end of input. */
+int builtin_read(char **argv, int argc, struct bstream *in) {
+    PROF_FUNC;
+    static char *line = NULL;
+    static size_t cap = 0;
+    static struct rd_buf redir_rd, chan_rd;
+    int raw = 0, first = 1;
+    if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+        raw = 1;
+        first = 2;
+    }
+    char *reply[] = { "REPLY" };
+    char **names = argc > first ? argv + first : reply;
+    int nnames = argc > first ? argc - first : 1;
+    if (nnames > MAXARGS) {
+        // brace expansion can make argv longer than the field table
+        fprintf(stderr, "Invalid Command\n");
+        return 1;
+    }
+    for (int i = 0; i < nnames; ++i) {
+        if (names[i][var_name_len(names[i])] != '\0' || var_name_len(names[i]) == 0) {
+            fprintf(stderr, "Invalid Command\n");
+            return 1;
+        }
+    }
+
+    // the shell's stdin uses its read-ahead buffer, a channel is read in place;
+    // 'read x < file' reads its own fd byte by byte, leaving the offset exact
+    struct rd_buf *rb = rd_in;
+    if (in->ch) {
+        rb = &chan_rd;
+        rd_init(rb, -1);
+        rb->ch = in->ch;
+    } else if (in->fd != STDIN_FILENO) {
+        rb = &redir_rd;
+        rd_init(rb, in->fd);
+        rb->seekable = 0;
+        rb->shared = 1;
+    }
+
+    size_t fstart[MAXARGS], fend[MAXARGS];
+    int field = -1, nf = 0, got = 0, c;
+    size_t len = 0, keep = 0;   // keep: length without trailing blanks
+    while ((c = rd_getc(rb)) != EOF) {
+        got = 1;
+        if (c == '\n') break;
+        int lit = 0;
+        if (c == '\\' && !raw) {
+            c = rd_getc(rb);
+            if (c == EOF) break;
+            if (c == '\n') continue;
+            lit = 1;
+        }
+        if (!lit && (c == ' ' || c == '\t')) {
+            if (field < 0) continue;            // leading or separating blanks
+            if (field < nnames - 1) {
+                fend[field] = len;
+                field = -1;
+                continue;
+            }
+            // blanks inside the last field are kept
+        } else if (field < 0) {
+            field = nf++;
+            fstart[field] = len;
+        }
+        if (len + 1 >= cap) {
+            cap = cap ? cap * 2 : 256;
+            line = realloc(line, cap);
+        }
+        line[len++] = c;
+        if (lit || (c != ' ' && c != '\t')) keep = len;
+    }
+    if (field >= 0) fend[field] = (field == nnames - 1) ? keep : len;
+    for (int i = 0; i < nnames; ++i) {
+        if (i < nf) var_set(names[i], strlen(names[i]), line + fstart[i], fend[i] - fstart[i]);
+        else var_set(names[i], strlen(names[i]), "", 0);
+    }
+    if (rb == &chan_rd) chan_consume(rb->ch, rb->pos);    // what was read is gone
+    return (c == EOF || !got) ? 1 : 0;
+}
+
+/* Built-in cat: cat [file|-]... Returns exit status. */
+int builtin_cat(char **argv, int argc, struct bstream *in, struct bstream *out) {
+    PROF_FUNC;
+    int status = 0;
+    if (argc == 1) return bs_copy(in, out) == 0 ? 0 : 1;
+    for (int i = 1; i < argc; ++i) {
+        struct bstream src = *in;
+        if (strcmp(argv[i], "-") != 0) {
+            src.ch = NULL;
+            src.fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+            if (src.fd < 0) {
+                perror("Invalid Command");
+                status = 1;
+                continue;
+            }
+        }
+        if (bs_copy(&src, out) != 0) {
+            if (errno != EPIPE) perror("Invalid Command");
+            status = 1;
+        }
+        if (src.fd != in->fd) close(src.fd);
+    }
+    return status;
+}
+
+/* Built-in cp: cp src dst, or cp src... dir. The stats and the src/dst opens are batched. */
+int builtin_cp(char **argv, int argc) {
+    PROF_FUNC;
+    if (argc < 3) {
+        fprintf(stderr, "Invalid Command\n");
+        return 1;
+    }
+    int nsrc = argc - 2;
+    const char *dst = argv[argc - 1];
+    const char **paths = line_alloc(sizeof(char*) * (nsrc + 1));
+    struct statx *sx = line_alloc(sizeof(struct statx) * (nsrc + 1));
+    int *sres = line_alloc(sizeof(int) * (nsrc + 1));
+    for (int i = 0; i < nsrc; ++i) paths[i] = argv[i + 1];
+    paths[nsrc] = dst;
+    io_statx_batch(paths, nsrc + 1, 0, STATX_TYPE | STATX_MODE | STATX_INO, sx, sres);
+
+    int dst_is_dir = (sres[nsrc] == 0 && S_ISDIR(sx[nsrc].stx_mode));
+    int status = 0;
+    if (nsrc > 1 && !dst_is_dir) {
+        fprintf(stderr, "Invalid Command\n");
+        status = 1;
+        nsrc = 0;
+    }
+    for (int i = 0; i < nsrc; ++i) {
+        if (sres[i] != 0 || S_ISDIR(sx[i].stx_mode)) {
+            errno = sres[i] ? -sres[i] : EISDIR;
+            perror("Invalid Command");
+            status = 1;
+            continue;
+        }
+        char target[4096];
+        struct statx tx;
+        int tres = sres[nsrc];
+        if (dst_is_dir) {
+            const char *base = strrchr(paths[i], '/');
+            base = base ? base + 1 : paths[i];
+            snprintf(target, sizeof(target), "%s/%s", dst, base);
+            tres = statx(AT_FDCWD, target, 0, STATX_INO, &tx);
+        } else {
+            snprintf(target, sizeof(target), "%s", dst);
+            tx = sx[nsrc];
+        }
+        if (tres == 0 && tx.stx_ino == sx[i].stx_ino &&
+            tx.stx_dev_major == sx[i].stx_dev_major && tx.stx_dev_minor == sx[i].stx_dev_minor) {
+            fprintf(stderr, "Invalid Command\n");   // source and destination are the same file
+            status = 1;
+            continue;
+        }
+        struct open_req reqs[2] = {
+            { paths[i], O_RDONLY | O_CLOEXEC, 0, -1 },
+            { target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, sx[i].stx_mode & 0777, -1 },
+        };
+        if (io_open_batch(reqs, 2) != 0) {
+            perror("Invalid Command");
+            status = 1;
+            continue;
+        }
+        if (io_copy_fd(reqs[0].fd, reqs[1].fd) != 0) {
+            perror("Invalid Command");
+            status = 1;
+        }
+        close(reqs[0].fd);
+        close(reqs[1].fd);
+    }
+    return status;
+}
+
+/* ---- sort builtin: sort [-n] [-r] [-u] [file|-]... ----
+   Byte order (as LC_ALL=C sort); -n orders by the leading number, with the
+   whole line as the tie-break, like GNU sort. Regular files are mmap'd and
+   sorted in place; pipes, channels and /dev/fd inputs are read into blocks.
+   Each line becomes a record (first 8 bytes as a big-endian key, pointer,
+   length). The records are cut into one slice per CPU, merge-sorted by a
+   thread each, and the slices merged pairwise in parallel rounds. Input beyond
+   the memory budget (MTL458_SORT_MEM, bytes with an optional K/M/G suffix,
+   default 1G) is sorted in budget-sized chunks written to unlinked temp files
+   in $TMPDIR, which are then mmap'd and k-way merged into the output.
+*/
+#define SORT_BLOCK (4 << 20)
+#define SORT_MAX_THREADS 16
+#define SORT_OBUF 65536
+
+static int sort_key_only;      // -nu: lines with equal numbers are duplicates, keep the first
+
+struct sort_rec {
+    uint64_t key;           // first 8 bytes big-endian, or the ordered bits of the -n value
+    const char *s;
+    size_t len;             // without the newline
+};
+
+struct sort_opts {
+    int numeric, reverse, unique;
+};
+
+struct sort_state {
+    struct sort_opts o;
+    size_t budget, used;        // bytes held: line text and two records per line
+    struct sort_rec *recs;
+    size_t nrec, cap;
+    char **blocks;              // text read from streams for the current chunk
+    int nblocks;
+    struct iovec *maps;         // mmap'd input files
+    int nmaps;
+    int runs[256];              // spilled, sorted chunks (unlinked files)
+    int nruns;
+};
+
+struct sort_out {
+    struct bstream *out;
+    char *buf;
+    size_t n;
+    const char *prev;           // last line written, for -u
+    size_t prev_len;
+    uint64_t prev_key;
+    int unique, have_prev, failed;
+};
+
+/* -n: the leading number of the line as a double, mapped onto ordered key bits */
+uint64_t sort_numkey(const char *s, size_t len) {
+    size_t i = 0;
+    while (i < len && (s[i] == ' ' || s[i] == '\t')) i++;
+    int neg = i < len && s[i] == '-';
+    if (neg) i++;
+    double v = 0, scale = 1;
+    while (i < len && isdigit((unsigned char)s[i])) v = v * 10 + (s[i++] - '0');
+    if (i < len && s[i] == '.') {
+        for (i++; i < len && isdigit((unsigned char)s[i]); ++i) {
+            scale /= 10;
+            v += (s[i] - '0') * scale;
+        }
+    }
+    if (neg) v = -v;
+    if (v == 0) v = 0;      // -0 sorts with 0
+    uint64_t b;
+    memcpy(&b, &v, sizeof(b));
+    return (b >> 63) ? ~b : b | (1ULL << 63);
+}
+
+void sort_key(struct sort_rec *r, const char *s, size_t len, int numeric) {
+    r->s = s;
+    r->len = len;
+    if (numeric) {
+        r->key = sort_numkey(s, len);
+        return;
+    }
+    uint64_t k = 0;
+    for (size_t i = 0; i < 8; ++i) k = (k << 8) | (i < len ? (unsigned char)s[i] : 0);
+    r->key = k;
+}
+
+static inline int sort_cmp(const struct sort_rec *a, const struct sort_rec *b) {
+    if (a->key != b->key) return a->key < b->key ? -1 : 1;
+    if (sort_key_only) return 0;
+    size_t n = a->len < b->len ? a->len : b->len;
+    int c = memcmp(a->s, b->s, n);
+    if (c) return c;
+    return (a->len > b->len) - (a->len < b->len);
+}
+
+void sort_merge(const struct sort_rec *x, size_t nx, const struct sort_rec *y, size_t ny, struct sort_rec *out) {
+    while (nx && ny) {
+        if (sort_cmp(y, x) < 0) { *out++ = *y++; ny--; }
+        else { *out++ = *x++; nx--; }
+    }
+    memcpy(out, x, nx * sizeof(*x));
+    memcpy(out + nx, y, ny * sizeof(*y));
+}
+
+/* Bottom-up merge sort of a[0..n) using tmp; the result ends up in a */
+void sort_msort(struct sort_rec *a, struct sort_rec *tmp, size_t n) {
+    const size_t RUN = 16;
+    for (size_t lo = 0; lo < n; lo += RUN) {
+        size_t hi = lo + RUN < n ? lo + RUN : n;
+        for (size_t i = lo + 1; i < hi; ++i) {
+            struct sort_rec r = a[i];
+            size_t j = i;
+            while (j > lo && sort_cmp(&r, &a[j - 1]) < 0) { a[j] = a[j - 1]; j--; }
+            a[j] = r;
+        }
+    }
+    struct sort_rec *src = a, *dst = tmp;
+    for (size_t w = RUN; w < n; w *= 2) {
+        for (size_t i = 0; i < n; i += 2 * w) {
+            size_t m = i + w < n ? i + w : n, e = i + 2 * w < n ? i + 2 * w : n;
+            sort_merge(src + i, m - i, src + m, e - m, dst + i);
+        }
+        struct sort_rec *t = src; src = dst; dst = t;
+    }
+    if (src != a) memcpy(a, src, n * sizeof(*a));
+}
+
+struct sort_job {
+    struct sort_rec *a, *tmp;
+    size_t lo, mid, hi;     // sort [lo, hi), or merge [lo, mid) and [mid, hi) from a into tmp
+    int merge;
+};
+
+void *sort_worker(void *arg) {
+    struct sort_job *j = arg;
+    if (j->merge) sort_merge(j->a + j->lo, j->mid - j->lo, j->a + j->mid, j->hi - j->mid, j->tmp + j->lo);
+    else sort_msort(j->a + j->lo, j->tmp + j->lo, j->hi - j->lo);
+    return NULL;
+}
+
+/* Sort the records with one thread per CPU; returns the array holding the result (recs or tmp) */
+struct sort_rec *sort_parallel(struct sort_rec *recs, struct sort_rec *tmp, size_t n) {
+    PROF_FUNC;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int t = ncpu < 1 ? 1 : ncpu > SORT_MAX_THREADS ? SORT_MAX_THREADS : (int)ncpu;
+    while (t > 1 && n / t < 65536) t /= 2;  // small inputs are not worth the threads
+    size_t bounds[SORT_MAX_THREADS + 1];
+    for (int i = 0; i <= t; ++i) bounds[i] = n * i / t;
+    pthread_t th[SORT_MAX_THREADS];
+    struct sort_job jobs[SORT_MAX_THREADS];
+    for (int i = 0; i < t; ++i) {
+        jobs[i] = (struct sort_job){ recs, tmp, bounds[i], 0, bounds[i + 1], 0 };
+        if (i == t - 1 || pthread_create(&th[i], NULL, sort_worker, &jobs[i]) != 0) {
+            sort_worker(&jobs[i]);
+            th[i] = 0;
+        }
+    }
+    for (int i = 0; i < t; ++i) if (th[i]) pthread_join(th[i], NULL);
+    // merge rounds: slices [b0,b1) + [b1,b2), ... into the other array
+    struct sort_rec *src = recs, *dst = tmp;
+    for (int w = 1; w < t; w *= 2) {
+        int nj = 0;
+        for (int i = 0; i < t; i += 2 * w) {
+            size_t lo = bounds[i], mid = bounds[i + w < t ? i + w : t], hi = bounds[i + 2 * w < t ? i + 2 * w : t];
+            jobs[nj] = (struct sort_job){ src, dst, lo, mid, hi, 1 };
+            th[nj] = 0;
+            if (pthread_create(&th[nj], NULL, sort_worker, &jobs[nj]) != 0) sort_worker(&jobs[nj]);
+            nj++;
+        }
+        for (int i = 0; i < nj; ++i) if (th[i]) pthread_join(th[i], NULL);
+        struct sort_rec *x = src; src = dst; dst = x;
+    }
+    return src;
+}
+
+void sort_emit(struct sort_out *o, const struct sort_rec *r, int numeric) {
+    if (o->failed) return;
+    if (o->unique && o->have_prev && (numeric ? r->key == o->prev_key
+                                                : r->len == o->prev_len && memcmp(r->s, o->prev, r->len) == 0)) return;
+    o->prev = r->s;
+    o->prev_len = r->len;
+    o->prev_key = r->key;
+    o->have_prev = 1;
+    if (o->n + r->len + 1 > SORT_OBUF) {
+        if (bs_write(o->out, o->buf, o->n) != 0) o->failed = 1;
+        o->n = 0;
+        if (r->len + 1 > SORT_OBUF) {
+            if (bs_write(o->out, r->s, r->len) != 0 || bs_write(o->out, "\n", 1) != 0) o->failed = 1;
+            return;
+        }
+    }
+    memcpy(o->buf + o->n, r->s, r->len);
+    o->n += r->len;
+    o->buf[o->n++] = '\n';
+}
+
+/* Output the records in order (backwards for -r, still taking the first of equal lines) */
+int sort_write(struct sort_rec *recs, size_t n, const struct sort_opts *o, struct bstream *out) {
+    struct sort_out so = { out, malloc(SORT_OBUF), 0, NULL, 0, 0, o->unique, 0, 0 };
+    if (!o->reverse) {
+        for (size_t i = 0; i < n; ++i) sort_emit(&so, &recs[i], o->numeric);
+    } else {
+        for (size_t i = n; i > 0; --i) {
+            size_t j = i - 1;
+            if (sort_key_only) while (j > 0 && recs[j - 1].key == recs[i - 1].key) j--;
+            sort_emit(&so, &recs[j], o->numeric);
+            i = j + 1;
+        }
+    }
+    if (!so.failed && so.n && bs_write(out, so.buf, so.n) != 0) so.failed = 1;
+    free(so.buf);
+    return so.failed ? -1 : 0;
+}
+
+/* Sort the current chunk into an unlinked temp file and drop its text */
+int sort_spill(struct sort_state *st) {
+    PROF_FUNC;
+    if (st->nrec == 0) return 0;
+    const char *dir = getenv("TMPDIR");
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/mtlsh-sortXXXXXX", dir && *dir ? dir : "/tmp");
+    int fd = st->nruns < 256 ? mkostemp(path, O_CLOEXEC) : -1;
+    if (fd < 0) return -1;
+    unlink(path);
+    struct sort_rec *tmp = malloc(st->nrec * sizeof(*tmp));
+    struct sort_rec *sorted = sort_parallel(st->recs, tmp, st->nrec);
+    struct bstream run = { fd, NULL, NULL, 0 };
+    int r = sort_write(sorted, st->nrec, &st->o, &run);
+    bs_flush(&run);
+    free(tmp);
+    for (int i = 0; i < st->nblocks; ++i) free(st->blocks[i]);
+    st->nblocks = 0;
+    st->nrec = 0;
+    st->used = 0;
+    st->runs[st->nruns++] = fd;
+    return r;
+}
+
+void sort_add(struct sort_state *st, const char *s, size_t len) {
+    if (st->nrec == st->cap) {
+        st->cap = st->cap ? st->cap * 2 : 65536;
+        st->recs = realloc(st->recs, st->cap * sizeof(*st->recs));
+    }
+    sort_key(&st->recs[st->nrec++], s, len, st->o.numeric);
+    st->used += len + 1 + 2 * sizeof(struct sort_rec);
+}
+
+/* Lines of a pipe, channel or other non-file input, read into blocks */
+int sort_read_stream(struct sort_state *st, struct bstream *in) {
+    char *blk = NULL;
+    size_t cap = 0, len = 0, start = 0;     // [start, len): the line not finished yet
+    while (1) {
+        if (len == cap) {
+            // block full: carry the unfinished line over to a new one
+            size_t part = len - start, ncap = SORT_BLOCK;
+            while (ncap < part * 2) ncap *= 2;
+            char *nb = malloc(ncap);
+            if (part) memcpy(nb, blk + start, part);
+            if (blk && start == 0) free(blk);   // no line of it was kept
+            else if (blk) {
+                st->blocks = realloc(st->blocks, sizeof(char *) * (st->nblocks + 1));
+                st->blocks[st->nblocks++] = blk;
+            }
+            if (st->used > st->budget && sort_spill(st) != 0) {
+                free(nb);
+                return -1;
+            }
+            blk = nb;
+            cap = ncap;
+            len = part;
+            start = 0;
+        }
+        ssize_t r;
+        if (in->ch) {
+            char *p;
+            r = chan_peek(in->ch, &p);
+            if ((size_t)r > cap - len) r = cap - len;
+            memcpy(blk + len, p, r);
+            chan_consume(in->ch, r);
+        } else {
+            r = read(in->fd, blk + len, cap - len);
+            if (r < 0 && errno == EINTR) continue;
+        }
+        if (r < 0) {
+            free(blk);
+            return -1;
+        }
+        if (r == 0) break;
+        for (char *p = blk + len, *e = blk + len + r; (p = memchr(p, '\n', e - p)) != NULL; ++p) {
+            sort_add(st, blk + start, p - (blk + start));
+            start = p + 1 - blk;
+        }
+        len += r;
+    }
+    if (start < len) sort_add(st, blk + start, len - start);
+    if (blk) {
+        st->blocks = realloc(st->blocks, sizeof(char *) * (st->nblocks + 1));
+        st->blocks[st->nblocks++] = blk;
+    }
+    return 0;
+}
+
+/* Lines of a regular file, in place in its mapping */
+int sort_read_file(struct sort_state *st, int fd, size_t size) {
+    char *m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m == MAP_FAILED) return -1;
+    madvise(m, size, MADV_SEQUENTIAL);
+    st->maps = realloc(st->maps, sizeof(struct iovec) * (st->nmaps + 1));
+    st->maps[st->nmaps++] = (struct iovec){ m, size };
+    const char *p = m, *e = m + size;
+    while (p < e) {
+        const char *nl = memchr(p, '\n', e - p);
+        if (!nl) nl = e;
+        sort_add(st, p, nl - p);
+        p = nl + 1;
+        if (st->used > st->budget && sort_spill(st) != 0) return -1;
+    }
+    return 0;
+}
+
+struct sort_cur {
+    const char *p, *end;
+    struct sort_rec r;
+};
+
+/* Load the next line of a run into its cursor; 0 at the end of the run */
+int sort_cur_next(struct sort_cur *c, int numeric) {
+    if (c->p >= c->end) return 0;
+    const char *nl = memchr(c->p, '\n', c->end - c->p);
+    if (!nl) nl = c->end;
+    sort_key(&c->r, c->p, nl - c->p, numeric);
+    c->p = nl + 1;
+    return 1;
+}
+
+static inline int sort_cur_before(const struct sort_cur *a, const struct sort_cur *b, int reverse) {
+    int c = sort_cmp(&a->r, &b->r);
+    if (c == 0) return a < b;   // runs are in input order
+    return reverse ? c > 0 : c < 0;
+}
+
+/* k-way merge of the spilled runs into out */
+int sort_merge_runs(struct sort_state *st, struct bstream *out) {
+    PROF_FUNC;
+    struct sort_cur *cur = calloc(st->nruns, sizeof(*cur));
+    int *heap = malloc(sizeof(int) * st->nruns), nh = 0;
+    size_t *lens = calloc(st->nruns, sizeof(size_t));
+    int status = 0;
+    for (int i = 0; i < st->nruns; ++i) {
+        struct stat sst;
+        if (fstat(st->runs[i], &sst) != 0 || sst.st_size == 0) continue;
+        char *m = mmap(NULL, sst.st_size, PROT_READ, MAP_PRIVATE, st->runs[i], 0);
+        if (m == MAP_FAILED) {
+            status = -1;
+            continue;
+        }
+        madvise(m, sst.st_size, MADV_SEQUENTIAL);
+        lens[i] = sst.st_size;
+        cur[i].p = m;
+        cur[i].end = m + sst.st_size;
+        if (sort_cur_next(&cur[i], st->o.numeric)) {
+            // sift up
+            int k = nh++;
+            heap[k] = i;
+            while (k > 0 && sort_cur_before(&cur[heap[k]], &cur[heap[(k - 1) / 2]], st->o.reverse)) {
+                int t = heap[k]; heap[k] = heap[(k - 1) / 2]; heap[(k - 1) / 2] = t;
+                k = (k - 1) / 2;
+            }
+        }
+    }
+    struct sort_out so = { out, malloc(SORT_OBUF), 0, NULL, 0, 0, st->o.unique, 0, 0 };
+    while (nh > 0 && !so.failed) {
+        struct sort_cur *top = &cur[heap[0]];
+        sort_emit(&so, &top->r, st->o.numeric);
+        if (!sort_cur_next(top, st->o.numeric)) heap[0] = heap[--nh];
+        // sift down
+        for (int k = 0;;) {
+            int l = 2 * k + 1, m = k;
+            if (l < nh && sort_cur_before(&cur[heap[l]], &cur[heap[m]], st->o.reverse)) m = l;
+            if (l + 1 < nh && sort_cur_before(&cur[heap[l + 1]], &cur[heap[m]], st->o.reverse)) m = l + 1;
+            if (m == k) break;
+            int t = heap[k]; heap[k] = heap[m]; heap[m] = t;
+            k = m;
+        }
+    }
+    if (!so.failed && so.n && bs_write(out, so.buf, so.n) != 0) so.failed = 1;
+    for (int i = 0; i < st->nruns; ++i)
+        if (lens[i]) munmap((char *)cur[i].end - lens[i], lens[i]);
+    free(so.buf);
+    free(cur);
+    free(heap);
+    free(lens);
+    return so.failed ? -1 : status;
+}
+
+/* Options the builtin handles itself; anything else is left to the real sort */
+int sort_opts_ok(char **argv, int argc) {
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i][0] != '-' || argv[i][1] == '\0') continue;
+        if (strspn(argv[i] + 1, "nru") != strlen(argv[i] + 1)) return 0;
+    }
+    return 1;
+}
+
+size_t sort_budget(void) {
+    const char *env = getenv("MTL458_SORT_MEM");
+    if (!env || !*env) return (size_t)1 << 30;
+    char *end;
+    size_t v = strtoull(env, &end, 10);
+    if (*end == 'K' || *end == 'k') v <<= 10;
+    else if (*end == 'M' || *end == 'm') v <<= 20;
+    else if (*end == 'G' || *end == 'g') v <<= 30;
+    return v ? v : 1;
+}
+
+int builtin_sort(char **argv, int argc, struct bstream *in, struct bstream *out) {
+    PROF_FUNC;
+    struct sort_state *st = calloc(1, sizeof(*st));
+    st->budget = sort_budget();
+    int nfiles = 0, status = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i][0] != '-' || argv[i][1] == '\0') { nfiles++; continue; }
+        for (const char *f = argv[i] + 1; *f; ++f) {
+            if (*f == 'n') st->o.numeric = 1;
+            else if (*f == 'r') st->o.reverse = 1;
+            else st->o.unique = 1;
+        }
+    }
+    sort_key_only = st->o.numeric && st->o.unique;
+    for (int i = nfiles ? 1 : 0; i < argc && status == 0; ++i) {
+        if (i > 0 && argv[i][0] == '-' && argv[i][1] != '\0') continue;
+        if (i == 0 || strcmp(argv[i], "-") == 0) {
+            if (sort_read_stream(st, in) != 0) {
+                perror("Invalid Command");
+                status = 2;
+            }
+            continue;
+        }
+        int fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+        struct stat sst;
+        if (fd < 0 || fstat(fd, &sst) != 0) {
+            perror("Invalid Command");
+            if (fd >= 0) close(fd);
+            status = 2;
+            break;
+        }
+        struct bstream src = { fd, NULL, NULL, 0 };
+        int r = !S_ISREG(sst.st_mode) ? sort_read_stream(st, &src)
+                                      : sst.st_size > 0 ? sort_read_file(st, fd, sst.st_size) : 0;
+        if (r != 0) {
+            perror("Invalid Command");
+            status = 2;
+        }
+        close(fd);
+    }
+    if (status == 0) {
+        int r;
+        if (st->nruns == 0) {
+            struct sort_rec *tmp = malloc((st->nrec ? st->nrec : 1) * sizeof(*tmp));
+            r = sort_write(sort_parallel(st->recs, tmp, st->nrec), st->nrec, &st->o, out);
+            free(tmp);
+        } else {
+            r = sort_spill(st) != 0 ? -1 : sort_merge_runs(st, out);
+        }
+        if (r != 0) {
+            if (errno != EPIPE) perror("Invalid Command");
+            status = 2;
+        }
+    }
+    for (int i = 0; i < st->nmaps; ++i) munmap(st->maps[i].iov_base, st->maps[i].iov_len);
+    for (int i = 0; i < st->nblocks; ++i) free(st->blocks[i]);
+    for (int i = 0; i < st->nruns; ++i) close(st->runs[i]);
+    free(st->maps);
+    free(st->blocks);
+    free(st->recs);
+    free(st);
+    return status;
+}
+
+/* Number of '\n' in p[0..n): byte compares 32 (AVX2) or 16 (SSE2) at a time,
+   popcount of the match masks */
+#if defined(__x86_64__)
+__attribute__((target("avx2,popcnt")))
+size_t count_newlines_avx2(const char *p, size_t n) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t c = 0, i = 0;
+    for (; i + 64 <= n; i += 64) {
+        uint64_t lo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), nl));
+        uint64_t hi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + 32)), nl));
+        c += __builtin_popcountll(lo | hi << 32);
+    }
+    for (; i < n; ++i) c += p[i] == '\n';
+    return c;
+}
+
+size_t count_newlines_sse2(const char *p, size_t n) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t c = 0, i = 0;
+    for (; i + 16 <= n; i += 16)
+        c += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), nl)));
+    for (; i < n; ++i) c += p[i] == '\n';
+    return c;
+}
+#endif
+
+size_t count_newlines(const char *p, size_t n) {
+#if defined(__x86_64__)
+    static size_t (*fn)(const char *, size_t);
+    if (!fn) fn = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt") ? count_newlines_avx2
+                                                                                       : count_newlines_sse2;
+    return fn(p, n);
+#else
+    size_t c = 0;
+    for (const char *e = p + n; p < e && (p = memchr(p, '\n', e - p)) != NULL; ++p) c++;
+    return c;
+#endif
+}
+
+/* ---- grep builtin: grep [-F] [-c] [-v] [-i] [-l] pattern [file|-]... ----
+   Fixed strings only: with -F, or a pattern without BRE special characters;
+   anything else runs the real grep. Candidates are found 32 (AVX2) or 16
+   (SSE2) positions at a time by comparing the pattern's first byte against a
+   block and its last byte against the block shifted by the pattern length;
+   only positions where both agree are verified. Without x86 SIMD, memchr on
+   the first byte is the filter. After a hit the search resumes at the end of
+   its line, so a line is looked at once however many times it matches.
+   Regular files are mmap'd; pipes and channels are read in large blocks and
+   searched up to their last newline. -i folds ASCII letters only.
+*/
+#define GREP_BUF (1 << 20)
+
+struct grep_state {
+    const char *(*find)(const struct grep_state *g, const char *p, const char *end);
+    const char *pat;            // lower-cased for -i
+    size_t plen;
+    char first[2], last[2];     // both cases (for -i) of the pattern's first and last bytes
+    int count, invert, icase, list;
+    const char *name;           // line prefix when several files are searched
+    struct bstream *out;
+    size_t nsel;                // lines selected in the current file
+    int stop, failed;
+};
+
+static inline int ascii_lower(int c) {
+    return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+static inline int grep_verify(const struct grep_state *g, const char *s) {
+    if (!g->icase) return memcmp(s, g->pat, g->plen) == 0;
+    for (size_t i = 0; i < g->plen; ++i)
+        if (ascii_lower((unsigned char)s[i]) != (unsigned char)g->pat[i]) return 0;
+    return 1;
+}
+
+const char *grep_find_scalar(const struct grep_state *g, const char *p, const char *end) {
+    if ((size_t)(end - p) < g->plen) return NULL;
+    const char *last = end - g->plen;
+    if (g->icase) {
+        for (; p <= last; ++p)
+            if ((*p == g->first[0] || *p == g->first[1]) && grep_verify(g, p)) return p;
+        return NULL;
+    }
+    while (p <= last && (p = memchr(p, g->first[0], last + 1 - p)) != NULL) {
+        if (grep_verify(g, p)) return p;
+        p++;
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__)
+const char *grep_find_sse2(const struct grep_state *g, const char *p, const char *end) {
+    size_t m = g->plen;
+    const __m128i f0 = _mm_set1_epi8(g->first[0]), f1 = _mm_set1_epi8(g->first[1]);
+    const __m128i l0 = _mm_set1_epi8(g->last[0]), l1 = _mm_set1_epi8(g->last[1]);
+    for (; end - p >= (ptrdiff_t)(m + 15); p += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + m - 1));
+        __m128i hit = _mm_and_si128(_mm_or_si128(_mm_cmpeq_epi8(a, f0), _mm_cmpeq_epi8(a, f1)),
+                                    _mm_or_si128(_mm_cmpeq_epi8(b, l0), _mm_cmpeq_epi8(b, l1)));
+        for (unsigned mask = _mm_movemask_epi8(hit); mask; mask &= mask - 1)
+            if (grep_verify(g, p + __builtin_ctz(mask))) return p + __builtin_ctz(mask);
+    }
+    return grep_find_scalar(g, p, end);
+}
+
+__attribute__((target("avx2")))
+const char *grep_find_avx2(const struct grep_state *g, const char *p, const char *end) {
+    size_t m = g->plen;
+    const __m256i f0 = _mm256_set1_epi8(g->first[0]), f1 = _mm256_set1_epi8(g->first[1]);
+    const __m256i l0 = _mm256_set1_epi8(g->last[0]), l1 = _mm256_set1_epi8(g->last[1]);
+    for (; end - p >= (ptrdiff_t)(m + 31); p += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + m - 1));
+        __m256i hit = _mm256_and_si256(_mm256_or_si256(_mm256_cmpeq_epi8(a, f0), _mm256_cmpeq_epi8(a, f1)),
+                                       _mm256_or_si256(_mm256_cmpeq_epi8(b, l0), _mm256_cmpeq_epi8(b, l1)));
+        for (unsigned mask = _mm256_movemask_epi8(hit); mask; mask &= mask - 1)
+            if (grep_verify(g, p + __builtin_ctz(mask))) return p + __builtin_ctz(mask);
+    }
+    return grep_find_sse2(g, p, end);
+}
+#endif
+
+/* Take the lines [s, e) (the last one may lack its newline) as selected */
+void grep_select(struct grep_state *g, const char *s, const char *e) {
+    if (g->list) {
+        g->nsel++;
+        g->stop = 1;
+        return;
+    }
+    if (g->count) {
+        g->nsel += count_newlines(s, e - s) + (e[-1] != '\n');
+        return;
+    }
+    g->nsel++;
+    int r = 0;
+    if (!g->name) {
+        r = bs_write(g->out, s, e - s);
+        if (e[-1] != '\n') r |= bs_write(g->out, "\n", 1);
+    } else {
+        size_t nlen = strlen(g->name);
+        while (s < e && r == 0) {
+            const char *nl = memchr(s, '\n', e - s);
+            const char *le = nl ? nl + 1 : e;
+            r = bs_write(g->out, g->name, nlen) | bs_write(g->out, ":", 1) | bs_write(g->out, s, le - s);
+            if (!nl) r |= bs_write(g->out, "\n", 1);
+            s = le;
+        }
+    }
+    if (r != 0) g->failed = g->stop = 1;
+}
+
+/* Search whole lines in [p, end); the last one may lack its newline */
+void grep_lines(struct grep_state *g, const char *p, const char *end) {
+    while (p < end && !g->stop) {
+        const char *m = g->plen ? g->find(g, p, end) : p;
+        const char *ls = end;
+        if (m) {
+            ls = memrchr(p, '\n', m - p);
+            ls = ls ? ls + 1 : p;
+        }
+        if (g->invert && ls > p) grep_select(g, p, ls);    // no match in any of these
+        if (!m) break;
+        const char *le = memchr(m, '\n', end - m);
+        le = le ? le + 1 : end;
+        if (!g->invert) grep_select(g, ls, le);
+        p = le;
+    }
+}
+
+int grep_input(struct grep_state *g, struct bstream *in) {
+    struct stat st;
+    if (!in->ch && fstat(in->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        lseek(in->fd, 0, SEEK_CUR) == 0) {
+        char *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+        if (m != MAP_FAILED) {
+            madvise(m, st.st_size, MADV_SEQUENTIAL);
+            grep_lines(g, m, m + st.st_size);
+            munmap(m, st.st_size);
+            return 0;
+        }
+    }
+    size_t cap = GREP_BUF, len = 0;
+    char *buf = malloc(cap);
+    while (!g->stop) {
+        if (len == cap) buf = realloc(buf, cap *= 2);   // one line longer than the buffer
+        ssize_t r;
+        if (in->ch) {
+            char *p;
+            r = chan_peek(in->ch, &p);
+            if ((size_t)r > cap - len) r = cap - len;
+            memcpy(buf + len, p, r);
+            chan_consume(in->ch, r);
+        } else {
+            r = read(in->fd, buf + len, cap - len);
+            if (r < 0 && errno == EINTR) continue;
+        }
+        if (r < 0) {
+            free(buf);
+            return -1;
+        }
+        if (r == 0) break;
+        char *nl = memrchr(buf + len, '\n', r);
+        len += r;
+        if (!nl) continue;
+        grep_lines(g, buf, nl + 1);
+        len = buf + len - (nl + 1);
+        memmove(buf, nl + 1, len);
+    }
+    if (len && !g->stop) grep_lines(g, buf, buf + len);
+    free(buf);
+    return 0;
+}
+
+/* Flags among -F -c -v -i -l and a fixed-string pattern; anything else runs the real grep */
+int grep_opts_ok(char **argv, int argc) {
+    const char *pat = NULL;
+    int fixed = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            if (strspn(argv[i] + 1, "Fcvil") != strlen(argv[i] + 1)) return 0;
+            if (strchr(argv[i], 'F')) fixed = 1;
+        } else if (!pat) {
+            pat = argv[i];
+        }
+    }
+    return pat && (fixed || strpbrk(pat, "\\.[]*^$") == NULL);
+}
+
+int builtin_grep(char **argv, int argc, struct bstream *in, struct bstream *out) {
+    PROF_FUNC;
+    struct grep_state g = { 0 };
+    int pat = 0, nfiles = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            g.count |= strchr(argv[i], 'c') != NULL;
+            g.invert |= strchr(argv[i], 'v') != NULL;
+            g.icase |= strchr(argv[i], 'i') != NULL;
+            g.list |= strchr(argv[i], 'l') != NULL;
+        } else if (!pat) {
+            pat = i;
+        } else {
+            nfiles++;
+        }
+    }
+    g.plen = strlen(argv[pat]);
+    char *lp = line_strdup(argv[pat]);
+    for (size_t i = 0; g.icase && i < g.plen; ++i) lp[i] = ascii_lower((unsigned char)lp[i]);
+    g.pat = lp;
+    if (g.plen) {
+        g.first[0] = g.first[1] = lp[0];
+        g.last[0] = g.last[1] = lp[g.plen - 1];
+        if (g.icase) {
+            g.first[1] = toupper((unsigned char)lp[0]);
+            g.last[1] = toupper((unsigned char)lp[g.plen - 1]);
+        }
+    }
+#if defined(__x86_64__)
+    g.find = __builtin_cpu_supports("avx2") ? grep_find_avx2 : grep_find_sse2;
+#else
+    g.find = grep_find_scalar;
+#endif
+    g.out = out;
+    int status = 1, err = 0;
+    for (int i = nfiles ? 1 : 0; i < argc && !g.failed; ++i) {
+        if (i > 0 && (i == pat || (argv[i][0] == '-' && argv[i][1] != '\0'))) continue;
+        struct bstream src = *in;
+        const char *name = "(standard input)";
+        if (i > 0 && strcmp(argv[i], "-") != 0) {
+            name = argv[i];
+            src.ch = NULL;
+            src.fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+            if (src.fd < 0) {
+                perror("Invalid Command");
+                err = 1;
+                continue;
+            }
+        }
+        g.name = nfiles > 1 ? name : NULL;
+        g.nsel = 0;
+        g.stop = 0;
+        if (grep_input(&g, &src) != 0) {
+            perror("Invalid Command");
+            err = 1;
+        }
+        if (src.fd != in->fd) close(src.fd);
+        if (g.nsel) status = 0;
+        if (g.list && g.nsel) {
+            if (bs_write(out, name, strlen(name)) != 0 || bs_write(out, "\n", 1) != 0) g.failed = 1;
+        } else if (g.count && !g.list) {
+            if (g.name) bs_printf(out, "%s:%zu\n", g.name, g.nsel);
+            else bs_printf(out, "%zu\n", g.nsel);
+        }
+    }
+    if (g.failed && errno != EPIPE) perror("Invalid Command");
+    return err || g.failed ? 2 : status;
+}
+
+/* ---- wc, head and tail builtins ----
+   wc -l/-c count newlines with count_newlines over an mmap of a regular file,
+   over a channel's buffer in place, or over large reads; -c alone on a
+   regular file is its size. Output is laid out as GNU wc does it. head stops
+   as soon as its count is reached; on a seekable input the bytes read past
+   that point are given back with lseek, so the next reader continues right
+   after the last line written. tail on a seekable file reads backwards from
+   EOF in HT_BUF blocks until it has seen enough newlines, then copies from
+   there; other inputs keep only a tail-sized window of what they read.
+   head/tail take -n N, -N and -c N (tail also +N); anything else runs the
+   real tool.
+*/
+#define HT_BUF 65536
+
+/* Next block of input: in place from a channel, otherwise read into buf */
+ssize_t ht_next(struct bstream *in, char *buf, size_t cap, char **p) {
+    if (in->ch) return chan_peek(in->ch, p);
+    *p = buf;
+    ssize_t r;
+    while ((r = read(in->fd, buf, cap)) < 0 && errno == EINTR) {}
+    return r;
+}
+
+/* Only used of the got bytes from ht_next were taken: the rest stays in the
+   channel, or goes back to a seekable fd */
+void ht_consume(struct bstream *in, size_t used, size_t got) {
+    if (in->ch) chan_consume(in->ch, used);
+    else if (used < got) lseek(in->fd, -(off_t)(got - used), SEEK_CUR);
+}
+
+int wc_opts_ok(char **argv, int argc) {
+    int flags = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i][0] != '-' || argv[i][1] == '\0') continue;
+        if (strspn(argv[i] + 1, "lc") != strlen(argv[i] + 1)) return 0;
+        flags = 1;
+    }
+    return flags;   // plain wc also counts words: left to the real wc
+}
+
+int wc_input(struct bstream *in, int lines, uint64_t *nl, uint64_t *nb, char *buf) {
+    char *p;
+    ssize_t n;
+    *nl = *nb = 0;
+    struct stat st;
+    off_t off;
+    if (!in->ch && fstat(in->fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        (off = lseek(in->fd, 0, SEEK_CUR)) >= 0 && off <= st.st_size) {
+        *nb = st.st_size - off;
+        if (lines && *nb) {
+            char *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+            if (m == MAP_FAILED) return -1;
+            madvise(m, st.st_size, MADV_SEQUENTIAL);
+            *nl = count_newlines(m + off, *nb);
+            munmap(m, st.st_size);
+        }
+        lseek(in->fd, 0, SEEK_END);
+        return 0;
+    }
+    while ((n = ht_next(in, buf, HT_BUF, &p)) > 0) {
+        *nl += count_newlines(p, n);
+        *nb += n;
+        ht_consume(in, n, n);
+    }
+    return n < 0 ? -1 : 0;
+}
+
+void wc_print(struct bstream *out, int lines, int bytes, int width, uint64_t nl, uint64_t nb, const char *name) {
+    if (lines) bs_printf(out, "%*" PRIu64, width, nl);
+    if (bytes) bs_printf(out, lines ? " %*" PRIu64 : "%*" PRIu64, width, nb);
+    if (name) bs_printf(out, " %s", name);
+    bs_write(out, "\n", 1);
+}
+
+int builtin_wc(char **argv, int argc, struct bstream *in, struct bstream *out) {
+    PROF_FUNC;
+    int lines = 0, bytes = 0, nfiles = 0, status = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            lines |= strchr(argv[i], 'l') != NULL;
+            bytes |= strchr(argv[i], 'c') != NULL;
+        } else {
+            nfiles++;
+        }
+    }
+    // column width: one bare count for a single input, else wide enough for
+    // the regular files' total size, and at least 7 with a pipe or terminal
+    int width = 1;
+    if (nfiles > 1 || lines + bytes > 1) {
+        uint64_t total = 0;
+        int min_width = 1;
+        for (int i = nfiles ? 1 : 0; i < argc; ++i) {
+            if (i > 0 && argv[i][0] == '-' && argv[i][1] != '\0') continue;
+            struct stat st;
+            int stdin_arg = i == 0 || strcmp(argv[i], "-") == 0;
+            if (stdin_arg && in->ch) min_width = 7;
+            else if ((stdin_arg ? fstat(in->fd, &st) : stat(argv[i], &st)) == 0) {
+                if (S_ISREG(st.st_mode)) total += st.st_size;
+                else min_width = 7;
+            }
+        }
+        for (; total >= 10; total /= 10) width++;
+        if (width < min_width) width = min_width;
+    }
+    char *buf = malloc(HT_BUF);
+    uint64_t tl = 0, tb = 0;
+    for (int i = nfiles ? 1 : 0; i < argc; ++i) {
+        if (i > 0 && argv[i][0] == '-' && argv[i][1] != '\0') continue;
+        struct bstream src = *in;
+        if (i > 0 && strcmp(argv[i], "-") != 0) {
+            src.ch = NULL;
+            src.fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+            if (src.fd < 0) {
+                perror("Invalid Command");
+                status = 1;
+                continue;
+            }
+        }
+        uint64_t nl, nb;
+        if (wc_input(&src, lines, &nl, &nb, buf) != 0) {
+            perror("Invalid Command");
+            status = 1;
+        } else {
+            wc_print(out, lines, bytes, width, nl, nb, i > 0 ? argv[i] : NULL);
+            tl += nl;
+            tb += nb;
+        }
+        if (src.fd != in->fd) close(src.fd);
+    }
+    if (nfiles > 1) wc_print(out, lines, bytes, width, tl, tb, "total");
+    free(buf);
+    return status;
+}
+
+/* head/tail options: -n N, -nN, -N, -c N, -cN, and for tail a +N count
+   (start at line/byte N). Returns the index of the first file, or -1 for
+   anything the builtin leaves to the real tool. */
+int ht_parse(char **argv, int argc, int tail, long long *n, int *bytes, int *from_start) {
+    *n = 10;
+    *bytes = *from_start = 0;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; ++i) {
+        const char *v = argv[i] + 1;
+        if (*v == 'n' || *v == 'c') {
+            *bytes = *v == 'c';
+            v = v[1] ? v + 1 : i + 1 < argc ? argv[++i] : NULL;
+            if (!v) return -1;
+        } else if (!isdigit((unsigned char)*v) || (tail && argc - i > 2)) {
+            return -1;      // tail's obsolete -N form only takes one file
+        }
+        *from_start = tail && *v == '+';
+        v += *from_start;
+        if (!isdigit((unsigned char)*v) || strspn(v, "0123456789") != strlen(v)) return -1;
+        *n = strtoll(v, NULL, 10);
+    }
+    for (int j = i; j < argc; ++j)
+        if (argv[j][0] == '-' && argv[j][1] != '\0') return -1;
+    return i;
+}
+
+/* Pass on the first n lines (or bytes) of in */
+int head_input(struct bstream *in, struct bstream *out, long long n, int bytes, char *buf) {
+    while (n > 0) {
+        char *p;
+        ssize_t got = ht_next(in, buf, HT_BUF, &p);
+        if (got <= 0) return got;
+        size_t used = got;
+        if (bytes) {
+            if (got > n) used = n;
+            n -= used;
+        } else {
+            for (char *q = p; n > 0 && (q = memchr(q, '\n', p + got - q)) != NULL; ++q)
+                if (--n == 0) used = q + 1 - p;
+        }
+        if (bs_write(out, p, used) != 0) return -1;
+        ht_consume(in, used, got);
+    }
+    return 0;
+}
+
+/* Offset in b[0..len) where its last n lines (or bytes) start; *need counts
+   down the newlines still to be found, so blocks can be fed from the end */
+size_t tail_start(const char *b, size_t len, long long *need, int *last_nl) {
+    size_t end = len;
+    if (*last_nl && end && b[end - 1] == '\n') end--;   // the final newline ends the last line
+    *last_nl = 0;
+    while (end > 0) {
+        const char *q = memrchr(b, '\n', end);
+        if (!q) break;
+        if (--*need < 0) return q + 1 - b;
+        end = q - b;
+    }
+    return 0;
+}
+
+int tail_input(struct bstream *in, struct bstream *out, long long n, int bytes, int from_start, char *buf) {
+    if (from_start) {
+        // skip the first n-1 lines or bytes, then copy the rest
+        long long skip = n > 0 ? n - 1 : 0;
+        while (skip > 0) {
+            char *p;
+            ssize_t got = ht_next(in, buf, HT_BUF, &p);
+            if (got <= 0) return got;
+            size_t used = got;
+            if (bytes) {
+                if (got > skip) used = skip;
+                skip -= used;
+            } else {
+                for (char *q = p; skip > 0 && (q = memchr(q, '\n', p + got - q)) != NULL; ++q)
+                    if (--skip == 0) used = q + 1 - p;
+            }
+            if (used < (size_t)got && bs_write(out, p + used, got - used) != 0) return -1;
+            ht_consume(in, got, got);
+        }
+        return bs_copy(in, out);
+    }
+    struct stat st;
+    off_t start;
+    if (!in->ch && fstat(in->fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        (start = lseek(in->fd, 0, SEEK_CUR)) >= 0 && start <= st.st_size) {
+        off_t from = start;
+        if (bytes) {
+            if (st.st_size - start > n) from = st.st_size - n;
+        } else {
+            // backwards from EOF, one block at a time, until n newlines are behind us
+            long long need = n - 1;
+            int last_nl = 1;
+            off_t pos = st.st_size;
+            from = n == 0 ? st.st_size : start;
+            while (n > 0 && pos > start) {
+                size_t len = pos - start < HT_BUF ? pos - start : HT_BUF;
+                pos -= len;
+                if (pread(in->fd, buf, len, pos) != (ssize_t)len) return -1;
+                size_t at = tail_start(buf, len, &need, &last_nl);
+                if (need < 0) {
+                    from = pos + at;
+                    break;
+                }
+            }
+        }
+        lseek(in->fd, from, SEEK_SET);
+        return bs_copy(in, out);
+    }
+    // a pipe or channel: keep a window that still holds the last n lines
+    size_t cap = HT_BUF, len = 0;
+    char *b = malloc(cap);
+    while (1) {
+        if (len == cap) {
+            long long need = n - 1;
+            int last_nl = 1;
+            size_t at = bytes ? (len > (size_t)n ? len - n : 0)
+                              : n == 0 ? len : tail_start(b, len, &need, &last_nl);
+            if (at > cap / 2) {
+                memmove(b, b + at, len - at);
+                len -= at;
+            } else {
+                b = realloc(b, cap *= 2);
+            }
+        }
+        char *p;
+        ssize_t got;
+        if (in->ch) {
+            got = chan_peek(in->ch, &p);
+            if ((size_t)got > cap - len) got = cap - len;
+            memcpy(b + len, p, got);
+            chan_consume(in->ch, got);
+        } else {
+            while ((got = read(in->fd, b + len, cap - len)) < 0 && errno == EINTR) {}
+        }
+        if (got < 0) {
+            free(b);
+            return -1;
+        }
+        if (got == 0) break;
+        len += got;
+    }
+    long long need = n - 1;
+    int last_nl = 1;
+    size_t at = bytes ? (len > (size_t)n ? len - n : 0) : n == 0 ? len : tail_start(b, len, &need, &last_nl);
+    int r = bs_write(out, b + at, len - at);
+    free(b);
+    return r;
+}
+
+/* head [-n N | -N | -c N] [file|-]... and tail [-n [+]N | -N | -c [+]N] [file|-]... */
+int builtin_head_tail(char **argv, int argc, struct bstream *in, struct bstream *out) {
+    PROF_FUNC;
+    int tail = strcmp(argv[0], "tail") == 0, bytes, from_start, status = 0;
+    long long n;
+    int first = ht_parse(argv, argc, tail, &n, &bytes, &from_start);
+    int nfiles = argc - first;
+    char *buf = malloc(HT_BUF);
+    for (int i = nfiles ? first : 0; i < (nfiles ? argc : 1); ++i) {
+        struct bstream src = *in;
+        const char *name = "standard input";
+        if (i > 0 && strcmp(argv[i], "-") != 0) {
+            name = argv[i];
+            src.ch = NULL;
+            src.fd = open(argv[i], O_RDONLY | O_CLOEXEC);
+            if (src.fd < 0) {
+                perror("Invalid Command");
+                status = 1;
+                continue;
+            }
+        }
+        if (nfiles > 1 && (!tail || n > 0 || from_start))    // GNU tail -n 0 has no headers
+            bs_printf(out, "%s==> %s <==\n", i > first ? "\n" : "", name);
+        int r = tail ? tail_input(&src, out, n, bytes, from_start, buf) : head_input(&src, out, n, bytes, buf);
+        if (src.fd != in->fd) close(src.fd);
+        if (r != 0) {
+            if (errno != EPIPE) perror("Invalid Command");
+            status = 1;
+            if (errno == EPIPE) break;
+        }
+    }
+    free(buf);
+    return status;
+}
+
+/* ---- find builtin: find [path...] [-name p] [-iname p] [-type c] [-newer f]
+        [-mindepth n] [-maxdepth n] [-print] [-exec cmd ... {} +] ----
+   The predicates are ANDed, so they are checked cheapest first: -name/-iname
+   on the getdents64 name, -type from d_type, and only then a statx for
+   -newer (or for d_type DT_UNKNOWN). Directories are scanned by a pool of
+   threads taking them from a shared stack; each one is opened with openat()
+   on its parent's fd, which stays open until the last child has opened. A
+   scanned directory keeps its selected paths plus the points where each
+   subdirectory's output goes, and the shell thread (which also scans while
+   it waits) writes the tree out depth first, so the output order is the
+   same as a serial find's. -exec ... {} + batches are posix_spawn'd as the
+   paths come out, with up to one batch per CPU running. Other expressions
+   (-o, !, -exec ... \;, ...) run the real find; with -exec the builtin is
+   not a pipeline stage.
+*/
+#define FIND_NAMES 8
+#define FIND_BATCH_BYTES (128 << 10)
+#define FIND_MAX_THREADS 16
+#define FIND_MAX_EXEC 16
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct find_node;
+
+struct find_cut {
+    size_t off;                 // position in the parent's output where this subtree goes
+    struct find_node *child;
+};
+
+struct find_node {
+    struct find_node *parent, *next;
+    char *path;
+    size_t name_off, len;
+    int depth, fd, refs;        // refs: children yet to openat() from fd, +1 while scanning
+    int done;
+    struct sbuf out;            // selected paths, NUL-terminated, in directory order
+    struct find_cut *cuts;
+    int ncuts, cutcap;
+};
+
+struct find_expr {
+    const char *names[FIND_NAMES];
+    int nnames, iname[FIND_NAMES];
+    int type;                   // DT_* wanted, 0 for any
+    int newer;
+    struct timespec newer_than;
+    int mindepth, maxdepth;
+    int print;
+    int exec_at, exec_n;        // argv index and length of the -exec command, before "{}"
+};
+
+struct find_ctx {
+    struct find_expr e;
+    pthread_mutex_t lock;
+    pthread_cond_t work, ready;
+    struct find_node *stack;
+    int quit, stop, errors;
+    int stop_errno;
+};
+
+int find_dt(mode_t m) {
+    return S_ISREG(m) ? DT_REG : S_ISDIR(m) ? DT_DIR : S_ISLNK(m) ? DT_LNK : S_ISFIFO(m) ? DT_FIFO
+         : S_ISSOCK(m) ? DT_SOCK : S_ISCHR(m) ? DT_CHR : S_ISBLK(m) ? DT_BLK : DT_UNKNOWN;
+}
+
+/* Parse the expression; -1 if it needs the real find. Returns the index of the first expression word. */
+int find_parse(char **argv, int argc, struct find_expr *e) {
+    memset(e, 0, sizeof(*e));
+    e->maxdepth = INT_MAX;
+    e->exec_at = -1;
+    int i = 1;
+    while (i < argc && argv[i][0] != '-' && strcmp(argv[i], "!") != 0 && strcmp(argv[i], "(") != 0) i++;
+    int first = i, explicit = 0;
+    for (; i < argc; ++i) {
+        const char *a = argv[i];
+        if (strcmp(a, "-print") == 0) {
+            e->print = explicit = 1;
+            continue;
+        }
+        if (strcmp(a, "-exec") == 0) {
+            int j = i + 1;
+            while (j < argc && strcmp(argv[j], "{}") != 0) j++;
+            if (e->exec_at >= 0 || j + 1 >= argc || j == i + 1 || strcmp(argv[j + 1], "+") != 0) return -1;
+            e->exec_at = i + 1;
+            e->exec_n = j - (i + 1);
+            explicit = 1;
+            i = j + 1;
+            continue;
+        }
+        if (i + 1 >= argc) return -1;
+        const char *v = argv[++i];
+        if (strcmp(a, "-name") == 0 || strcmp(a, "-iname") == 0) {
+            if (e->nnames == FIND_NAMES) return -1;
+            e->iname[e->nnames] = a[1] == 'i';
+            e->names[e->nnames++] = v;
+        } else if (strcmp(a, "-type") == 0) {
+            const char *types = "fdlpscb";
+            static const int dts[] = { DT_REG, DT_DIR, DT_LNK, DT_FIFO, DT_SOCK, DT_CHR, DT_BLK };
+            if (strlen(v) != 1 || !strchr(types, *v) || (e->type && e->type != dts[strchr(types, *v) - types])) return -1;
+            e->type = dts[strchr(types, *v) - types];
+        } else if (strcmp(a, "-newer") == 0) {
+            struct stat st;
+            if (e->newer || lstat(v, &st) != 0) return -1;  // the real find reports the missing file
+            e->newer = 1;
+            e->newer_than = st.st_mtim;
+        } else if ((strcmp(a, "-maxdepth") == 0 || strcmp(a, "-mindepth") == 0) &&
+                   *v && strspn(v, "0123456789") == strlen(v)) {
+            *(a[2] == 'a' ? &e->maxdepth : &e->mindepth) = atoi(v);
+        } else {
+            return -1;
+        }
+    }
+    if (!explicit) e->print = 1;
+    return first;
+}
+
+/* Does the entry name in dfd pass the expression? *type may be resolved from DT_UNKNOWN on the way */
+int find_match(struct find_expr *e, int dfd, const char *name, int *type, int depth) {
+    if (depth < e->mindepth) return 0;
+    for (int i = 0; i < e->nnames; ++i)
+        if (fnmatch(e->names[i], name, e->iname[i] ? FNM_CASEFOLD : 0) != 0) return 0;
+    struct statx sx;
+    if ((e->type && *type == DT_UNKNOWN) || e->newer) {
+        unsigned mask = (*type == DT_UNKNOWN ? STATX_TYPE : 0) | (e->newer ? STATX_MTIME : 0);
+        if (statx(dfd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, mask, &sx) != 0) return 0;
+        if (*type == DT_UNKNOWN) *type = find_dt(sx.stx_mode);
+    }
+    if (e->type && *type != e->type) return 0;
+    if (e->newer && (sx.stx_mtime.tv_sec < e->newer_than.tv_sec ||
+                     (sx.stx_mtime.tv_sec == e->newer_than.tv_sec && sx.stx_mtime.tv_nsec <= e->newer_than.tv_nsec)))
+        return 0;
+    return 1;
+}
+
+struct find_node *find_node_new(struct find_node *parent, const char *path, size_t len, size_t name_off, int depth) {
+    struct find_node *n = calloc(1, sizeof(*n));
+    n->parent = parent;
+    n->path = malloc(len + 1);
+    memcpy(n->path, path, len + 1);
+    n->len = len;
+    n->name_off = name_off;
+    n->depth = depth;
+    n->fd = -1;
+    n->refs = 1;
+    return n;
+}
+
+/* One child fewer needs n's fd (or n's own scan is over) */
+void find_release(struct find_node *n) {
+    if (__atomic_sub_fetch(&n->refs, 1, __ATOMIC_ACQ_REL) == 0 && n->fd >= 0) {
+        close(n->fd);
+        n->fd = -1;
+    }
+}
+
+/* Read one directory: record the selected entries and queue its subdirectories */
+void find_scan(struct find_ctx *fc, struct find_node *n, char *dbuf, size_t dcap) {
+    int pfd = n->parent ? n->parent->fd : AT_FDCWD;
+    if (!fc->stop)
+        n->fd = openat(pfd, n->parent ? n->path + n->name_off : n->path,
+                       O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (n->parent) find_release(n->parent);
+    if (n->fd < 0) {
+        if (!fc->stop) {
+            fprintf(stderr, "Invalid Command: %s: %s\n", n->path, strerror(errno));
+            __atomic_store_n(&fc->errors, 1, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+    struct find_expr *e = &fc->e;
+    struct find_node *kids = NULL, **tail = &kids;
+    char *path = malloc(n->len + 258);
+    memcpy(path, n->path, n->len);
+    size_t base = n->len;
+    if (base == 0 || path[base - 1] != '/') path[base++] = '/';
+    long got;
+    while (!fc->stop && (got = syscall(SYS_getdents64, n->fd, dbuf, dcap)) > 0) {
+        for (long off = 0; off < got;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(dbuf + off);
+            off += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            int type = d->d_type, depth = n->depth + 1;
+            int sel = find_match(e, n->fd, name, &type, depth);
+            if (type == DT_UNKNOWN && depth < e->maxdepth) {
+                struct statx sx;
+                if (statx(n->fd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, STATX_TYPE, &sx) == 0)
+                    type = find_dt(sx.stx_mode);
+            }
+            size_t nlen = strlen(name);
+            memcpy(path + base, name, nlen + 1);
+            if (sel) sb_put(&n->out, path, base + nlen + 1);
+            if (type == DT_DIR && depth < e->maxdepth) {
+                struct find_node *c = find_node_new(n, path, base + nlen, base, depth);
+                if (n->ncuts == n->cutcap) {
+                    n->cutcap = n->cutcap ? n->cutcap * 2 : 16;
+                    n->cuts = realloc(n->cuts, n->cutcap * sizeof(*n->cuts));
+                }
+                n->cuts[n->ncuts++] = (struct find_cut){ n->out.len, c };
+                __atomic_add_fetch(&n->refs, 1, __ATOMIC_RELAXED);
+                *tail = c;
+                tail = &c->next;
+            }
+        }
+    }
+    if (got < 0 && !fc->stop) {
+        fprintf(stderr, "Invalid Command: %s: %s\n", n->path, strerror(errno));
+        __atomic_store_n(&fc->errors, 1, __ATOMIC_RELAXED);
+    }
+    free(path);
+    if (kids) {
+        // on top of the stack, first subdirectory first: the output waits on it next
+        pthread_mutex_lock(&fc->lock);
+        *tail = fc->stack;
+        fc->stack = kids;
+        pthread_cond_broadcast(&fc->work);
+        pthread_mutex_unlock(&fc->lock);
+    }
+    find_release(n);
+}
+
+/* Take a directory off the stack and scan it; called and returns with fc->lock held */
+void find_step(struct find_ctx *fc, char *dbuf, size_t dcap) {
+    struct find_node *n = fc->stack;
+    fc->stack = n->next;
+    pthread_mutex_unlock(&fc->lock);
+    find_scan(fc, n, dbuf, dcap);
+    pthread_mutex_lock(&fc->lock);
+    n->done = 1;
+    pthread_cond_broadcast(&fc->ready);
+}
+
+void *find_worker(void *arg) {
+    struct find_ctx *fc = arg;
+    size_t dcap = 32768;
+    char *dbuf = malloc(dcap);
+    pthread_mutex_lock(&fc->lock);
+    while (1) {
+        while (!fc->stack && !fc->quit) pthread_cond_wait(&fc->work, &fc->lock);
+        if (!fc->stack) break;
+        find_step(fc, dbuf, dcap);
+    }
+    pthread_mutex_unlock(&fc->lock);
+    free(dbuf);
+    return NULL;
+}
+
+struct find_exec {
+    char **cmd;                 // the -exec words before "{}"
+    int ncmd;
+    char path[PATH_MAX];
+    struct sbuf args;           // NUL-separated paths of the pending batch
+    int nargs;
+    pid_t running[FIND_MAX_EXEC];
+    int nrun, maxrun, status;
+    int out_fd;
+};
+
+void find_exec_wait(struct find_exec *x) {
+    int st;
+    if (waitpid(x->running[0], &st, 0) > 0 && !(WIFEXITED(st) && WEXITSTATUS(st) == 0)) x->status = 1;
+    memmove(x->running, x->running + 1, --x->nrun * sizeof(pid_t));
+}
+
+/* Spawn the pending batch, first waiting for a slot if maxrun batches are running */
+void find_exec_flush(struct find_exec *x) {
+    if (x->nargs == 0) return;
+    if (x->nrun == x->maxrun) find_exec_wait(x);
+    char **argv = malloc((x->ncmd + x->nargs + 1) * sizeof(char *));
+    memcpy(argv, x->cmd, x->ncmd * sizeof(char *));
+    char *p = x->args.buf;
+    for (int i = 0; i < x->nargs; ++i, p += strlen(p) + 1) argv[x->ncmd + i] = p;
+    argv[x->ncmd + x->nargs] = NULL;
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    if (x->out_fd != STDOUT_FILENO) posix_spawn_file_actions_adddup2(&fa, x->out_fd, STDOUT_FILENO);
+    pid_t pid;
+    int err = posix_spawn(&pid, x->path, &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    if (err == 0) x->running[x->nrun++] = pid;
+    else {
+        errno = err;
+        perror("Invalid Command");
+        x->status = 1;
+    }
+    free(argv);
+    x->args.len = 0;
+    x->nargs = 0;
+}
+
+/* Write out (or hand to -exec) the NUL-terminated paths in [p, end) */
+int find_emit(struct find_ctx *fc, const char *p, const char *end, struct bstream *out, struct find_exec *x) {
+    while (p < end && !fc->stop) {
+        size_t len = strlen(p);
+        if (fc->e.print && (bs_write(out, p, len) != 0 || bs_write(out, "\n", 1) != 0)) return -1;
+        if (x) {
+            if (x->args.len + (x->nargs + 1) * sizeof(char *) + len + 1 > FIND_BATCH_BYTES) {
+                bs_flush(out);
+                fflush(stdout);
+                find_exec_flush(x);
+            }
+            sb_put(&x->args, p, len + 1);
+            x->nargs++;
+        }
+        p += len + 1;
+    }
+    return 0;
+}
+
+/* Write the tree under root in directory order, waiting for (or scanning) each
+   directory as its turn comes; every node is freed once written */
+void find_output(struct find_ctx *fc, struct find_node *root, struct bstream *out, struct find_exec *x,
+                 char *dbuf, size_t dcap) {
+    struct frame { struct find_node *n; int cut; size_t pos; } *st = malloc(64 * sizeof(*st));
+    int depth = 1, cap = 64;
+    st[0] = (struct frame){ root, -1, 0 };
+    while (depth > 0) {
+        struct frame *f = &st[depth - 1];
+        struct find_node *n = f->n;
+        if (f->cut < 0) {
+            pthread_mutex_lock(&fc->lock);
+            while (!n->done) {
+                if (fc->stack) find_step(fc, dbuf, dcap);
+                else pthread_cond_wait(&fc->ready, &fc->lock);
+            }
+            pthread_mutex_unlock(&fc->lock);
+            f->cut = 0;
+        }
+        size_t to = f->cut < n->ncuts ? n->cuts[f->cut].off : n->out.len;
+        if (find_emit(fc, n->out.buf + f->pos, n->out.buf + to, out, x) != 0) {
+            fc->stop_errno = errno;
+            fc->stop = 1;
+        }
+        f->pos = to;
+        if (f->cut < n->ncuts) {
+            struct find_node *c = n->cuts[f->cut++].child;
+            if (depth == cap) st = realloc(st, (cap *= 2) * sizeof(*st));
+            st[depth++] = (struct frame){ c, -1, 0 };
+            continue;
+        }
+        free(n->out.buf);
+        free(n->cuts);
+        free(n->path);
+        free(n);
+        depth--;
+    }
+    free(st);
+}
+
+int resolve_command(const char *name, char *out, size_t n);
+
+int builtin_find(char **argv, int argc, struct bstream *in, struct bstream *out) {
+    PROF_FUNC;
+    (void)in;
+    struct find_ctx fc = { 0 };
+    int first = find_parse(argv, argc, &fc.e);
+    struct find_exec xs = { 0 }, *x = NULL;
+    if (fc.e.exec_at >= 0) {
+        x = &xs;
+        x->cmd = argv + fc.e.exec_at;
+        x->ncmd = fc.e.exec_n;
+        x->out_fd = out->fd;
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        x->maxrun = ncpu < 1 ? 1 : ncpu > FIND_MAX_EXEC ? FIND_MAX_EXEC : ncpu;
+        if (resolve_command(x->cmd[0], x->path, sizeof(x->path)) != 0) {
+            fprintf(stderr, "Invalid Command\n");
+            return 1;
+        }
+    }
+    pthread_mutex_init(&fc.lock, NULL);
+    pthread_cond_init(&fc.work, NULL);
+    pthread_cond_init(&fc.ready, NULL);
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = ncpu < 4 ? 4 : ncpu > FIND_MAX_THREADS ? FIND_MAX_THREADS : ncpu;   // the walk mostly waits on I/O
+    pthread_t th[FIND_MAX_THREADS];
+    int started = 0;
+    size_t dcap = 32768;
+    char *dbuf = malloc(dcap);
+    char *dot[] = { "." };
+    char **paths = first > 1 ? argv + 1 : dot;
+    int npaths = first > 1 ? first - 1 : 1;
+    for (int i = 0; i < npaths && !fc.stop; ++i) {
+        struct stat sst;
+        if (lstat(paths[i], &sst) != 0) {
+            fprintf(stderr, "Invalid Command: %s: %s\n", paths[i], strerror(errno));
+            fc.errors = 1;
+            continue;
+        }
+        // the starting point is matched on its last component
+        size_t len = strlen(paths[i]), end = len;
+        while (end > 1 && paths[i][end - 1] == '/') end--;
+        size_t nb = end;
+        while (nb > 0 && paths[i][nb - 1] != '/') nb--;
+        char *name = line_strndup(paths[i] + nb, end - nb);
+        int type = find_dt(sst.st_mode);
+        struct find_expr *e = &fc.e;
+        int sel = 0 >= e->mindepth;
+        for (int k = 0; sel && k < e->nnames; ++k)
+            sel = fnmatch(e->names[k], name, e->iname[k] ? FNM_CASEFOLD : 0) == 0;
+        if (e->type && type != e->type) sel = 0;
+        if (e->newer && (sst.st_mtim.tv_sec < e->newer_than.tv_sec ||
+                         (sst.st_mtim.tv_sec == e->newer_than.tv_sec && sst.st_mtim.tv_nsec <= e->newer_than.tv_nsec)))
+            sel = 0;
+        struct find_node *root = find_node_new(NULL, paths[i], len, 0, 0);
+        if (sel) sb_put(&root->out, paths[i], len + 1);
+        if (type == DT_DIR && e->maxdepth > 0) {
+            struct find_node *top = find_node_new(NULL, paths[i], len, 0, 0);
+            root->cuts = malloc(sizeof(*root->cuts));
+            root->cuts[root->ncuts++] = (struct find_cut){ root->out.len, top };
+            pthread_mutex_lock(&fc.lock);
+            top->next = fc.stack;
+            fc.stack = top;
+            pthread_cond_broadcast(&fc.work);
+            pthread_mutex_unlock(&fc.lock);
+            for (; started < nthreads; ++started)
+                if (pthread_create(&th[started], NULL, find_worker, &fc) != 0) break;
+        }
+        root->done = 1;
+        find_output(&fc, root, out, x, dbuf, dcap);
+    }
+    pthread_mutex_lock(&fc.lock);
+    fc.quit = 1;
+    pthread_cond_broadcast(&fc.work);
+    pthread_mutex_unlock(&fc.lock);
+    for (int i = 0; i < started; ++i) pthread_join(th[i], NULL);
+    free(dbuf);
+    int status = fc.errors;
+    if (fc.stop) {
+        if (fc.stop_errno != EPIPE) fprintf(stderr, "Invalid Command: %s\n", strerror(fc.stop_errno));
+        status = 1;
+    }
+    if (x) {
+        bs_flush(out);
+        fflush(stdout);
+        if (!fc.stop) find_exec_flush(x);
+        while (x->nrun) find_exec_wait(x);
+        free(x->args.buf);
+        status |= x->status;
+    }
+    pthread_cond_destroy(&fc.work);
+    pthread_cond_destroy(&fc.ready);
+    pthread_mutex_destroy(&fc.lock);
+    return status;
+}
+
+/* ---- du builtin: du [-a] [-s] [-c] [-h] [-k] [-d N] [path...] ----
+   Each directory is one task. Worker threads keep their own deque of tasks:
+   a thread pushes the subdirectories it finds and pops them back LIFO,
+   and an idle thread steals the oldest task from another's deque. The
+   thread that scans a directory sums it alone (the directory's own blocks
+   and those of its non-directory entries) into the node, so no counter is
+   shared; subtree totals are added up bottom-up while the output is written,
+   in the order a serial du prints. Entries are sized with statx asking for
+   the block count only (plus the link count and inode needed to spot hard
+   links); directories found through d_type are not stat'ed before they are
+   opened, relative to their parent's fd. A file with several links is
+   counted once, through a (dev, inode) hash set; with several arguments
+   every entry goes through the set, as in GNU du. The set is consulted in
+   the output pass, so the link that is charged is the first one in du's
+   order, not the first one a thread happened to reach. Sizes are in 1K
+   units, or -h's rounded-up K/M/G. Other options run the real du.
+*/
+#define DU_MAX_THREADS 16
+
+struct du_node;
+
+struct du_item {                // a subdirectory, a file for -a, or a file to check against the set
+    char *name;                 // NULL unless it is printed (-a)
+    struct du_node *dir;
+    uint64_t bytes, dev, ino;   // ino 0: not a set candidate, bytes already in the node
+};
+
+struct du_node {
+    struct du_node *parent;
+    char *name;                 // path for a root, else the entry name
+    int depth, fd, refs;
+    uint64_t bytes;             // own blocks and its files; the whole subtree once written
+    uint64_t dev, ino;
+    struct du_item *items;
+    int nitems, cap;
+};
+
+struct du_deque {
+    pthread_mutex_t lock;
+    struct du_node **q;
+    int head, tail, cap;        // the owner works at the tail, thieves take from the head
+};
+
+struct du_ctx {
+    int all, maxdepth, human, hash_all;
+    int nthreads;
+    struct du_deque dq[DU_MAX_THREADS];
+    long pending;               // directories queued or being scanned
+    pthread_mutex_t idle_lock;  // idle workers park on wake until work_gen moves or pending is 0
+    pthread_cond_t wake;
+    int nidle;
+    unsigned long work_gen;
+    int errors;
+    uint64_t *seen;             // (dev, ino) pairs, open addressing; ino 0 marks a free slot
+    size_t seen_cap, nseen;
+};
+
+static inline uint64_t du_hash(uint64_t dev, uint64_t ino) {
+    return (ino * 0x9E3779B97F4A7C15ULL) ^ dev;
+}
+
+/* Add (dev, ino) to the set; 0 if it was already there */
+int du_seen_add(struct du_ctx *dc, uint64_t dev, uint64_t ino) {
+    if (2 * (dc->nseen + 1) > dc->seen_cap) {
+        size_t ncap = dc->seen_cap ? dc->seen_cap * 2 : 1024;
+        uint64_t *nk = calloc(ncap * 2, sizeof(uint64_t));
+        for (size_t i = 0; i < dc->seen_cap; ++i) {
+            if (!dc->seen[2 * i + 1]) continue;
+            size_t j = du_hash(dc->seen[2 * i], dc->seen[2 * i + 1]) % ncap;
+            while (nk[2 * j + 1]) j = (j + 1) % ncap;
+            nk[2 * j] = dc->seen[2 * i];
+            nk[2 * j + 1] = dc->seen[2 * i + 1];
+        }
+        free(dc->seen);
+        dc->seen = nk;
+        dc->seen_cap = ncap;
+    }
+    size_t j = du_hash(dev, ino) % dc->seen_cap;
+    for (; dc->seen[2 * j + 1]; j = (j + 1) % dc->seen_cap)
+        if (dc->seen[2 * j] == dev && dc->seen[2 * j + 1] == ino) return 0;
+    dc->seen[2 * j] = dev;
+    dc->seen[2 * j + 1] = ino;
+    dc->nseen++;
+    return 1;
+}
+
+static inline uint64_t du_dev(const struct statx *sx) {
+    return (uint64_t)sx->stx_dev_major << 32 | sx->stx_dev_minor;
+}
+
+void du_push(struct du_ctx *dc, int self, struct du_node *n) {
+    struct du_deque *d = &dc->dq[self];
+    __atomic_add_fetch(&dc->pending, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->cap) {
+        // slide the live part down, or grow
+        if (d->head > d->cap / 2) {
+            memmove(d->q, d->q + d->head, (d->tail - d->head) * sizeof(*d->q));
+            d->tail -= d->head;
+            d->head = 0;
+        } else {
+            d->cap = d->cap ? d->cap * 2 : 256;
+            d->q = realloc(d->q, d->cap * sizeof(*d->q));
+        }
+    }
+    d->q[d->tail++] = n;
+    pthread_mutex_unlock(&d->lock);
+    // pairs with the nidle increment in du_worker: either it sees this task or we see it idle
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&dc->nidle, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&dc->idle_lock);
+        dc->work_gen++;
+        pthread_cond_signal(&dc->wake);
+        pthread_mutex_unlock(&dc->idle_lock);
+    }
+}
+
+/* Own newest task, else the oldest task of another thread */
+struct du_node *du_take(struct du_ctx *dc, int self) {
+    struct du_node *n = NULL;
+    for (int k = 0; k < dc->nthreads && !n; ++k) {
+        struct du_deque *d = &dc->dq[(self + k) % dc->nthreads];
+        pthread_mutex_lock(&d->lock);
+        if (d->head < d->tail) n = k == 0 ? d->q[--d->tail] : d->q[d->head++];
+        pthread_mutex_unlock(&d->lock);
+    }
+    return n;
+}
+
+void du_release(struct du_node *n) {
+    if (__atomic_sub_fetch(&n->refs, 1, __ATOMIC_ACQ_REL) == 0 && n->fd >= 0) {
+        close(n->fd);
+        n->fd = -1;
+    }
+}
+
+struct du_item *du_add_item(struct du_node *n) {
+    if (n->nitems == n->cap) {
+        n->cap = n->cap ? n->cap * 2 : 16;
+        n->items = realloc(n->items, n->cap * sizeof(*n->items));
+    }
+    struct du_item *it = &n->items[n->nitems++];
+    memset(it, 0, sizeof(*it));
+    return it;
+}
+
+void du_scan(struct du_ctx *dc, int self, struct du_node *n, char *dbuf, size_t dcap) {
+    const unsigned mask = STATX_BLOCKS | STATX_NLINK | STATX_INO;
+    int pfd = n->parent ? n->parent->fd : AT_FDCWD;
+    struct statx sx;
+    n->fd = openat(pfd, n->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    int r = n->fd >= 0 ? statx(n->fd, "", AT_EMPTY_PATH, mask | STATX_TYPE, &sx)
+                       : statx(pfd, n->name, AT_SYMLINK_NOFOLLOW, mask | STATX_TYPE, &sx);
+    int err = n->fd < 0 ? errno : 0;
+    if (n->parent) du_release(n->parent);
+    if (r == 0 && n->parent) {
+        n->bytes = sx.stx_blocks * 512;
+        n->dev = du_dev(&sx);
+        n->ino = sx.stx_ino;
+    }
+    if (n->fd < 0) {
+        fprintf(stderr, "Invalid Command: %s: %s\n", n->name, strerror(err));
+        __atomic_store_n(&dc->errors, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    long got;
+    while ((got = syscall(SYS_getdents64, n->fd, dbuf, dcap)) > 0) {
+        for (long off = 0; off < got;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(dbuf + off);
+            off += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            int type = d->d_type;
+            if (type != DT_DIR) {
+                if (statx(n->fd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+                          mask | (type == DT_UNKNOWN ? STATX_TYPE : 0), &sx) != 0)
+                    continue;
+                if (type == DT_UNKNOWN) type = find_dt(sx.stx_mode);
+            }
+            if (type == DT_DIR) {
+                struct du_node *c = calloc(1, sizeof(*c));
+                c->parent = n;
+                c->name = strdup(name);
+                c->depth = n->depth + 1;
+                c->fd = -1;
+                c->refs = 1;
+                __atomic_add_fetch(&n->refs, 1, __ATOMIC_RELAXED);
+                du_add_item(n)->dir = c;
+                continue;
+            }
+            uint64_t b = sx.stx_blocks * 512;
+            int check = dc->hash_all || sx.stx_nlink > 1;   // decided in the output pass
+            int print = dc->all && n->depth + 1 <= dc->maxdepth;
+            if (!check) n->bytes += b;
+            if (check || print) {
+                struct du_item *it = du_add_item(n);
+                it->name = print ? strdup(name) : NULL;
+                it->bytes = b;
+                if (check) {
+                    it->dev = du_dev(&sx);
+                    it->ino = sx.stx_ino;
+                }
+            }
+        }
+    }
+    if (got < 0) {
+        fprintf(stderr, "Invalid Command: %s: %s\n", n->name, strerror(errno));
+        __atomic_store_n(&dc->errors, 1, __ATOMIC_RELAXED);
+    }
+    // queued last-first so the owner pops them in directory order
+    for (int i = n->nitems - 1; i >= 0; --i)
+        if (n->items[i].dir) du_push(dc, self, n->items[i].dir);
+    du_release(n);
+}
+
+struct du_worker_arg {
+    struct du_ctx *dc;
+    int self;
+};
+
+void *du_worker(void *arg) {
+    struct du_worker_arg *a = arg;
+    struct du_ctx *dc = a->dc;
+    size_t dcap = 32768;
+    char *dbuf = malloc(dcap);
+    while (1) {
+        struct du_node *n = du_take(dc, a->self);
+        if (!n) {
+            // go idle first, then look once more, so a du_push in between is not missed
+            pthread_mutex_lock(&dc->idle_lock);
+            unsigned long gen = dc->work_gen;
+            __atomic_add_fetch(&dc->nidle, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&dc->idle_lock);
+            n = du_take(dc, a->self);
+            pthread_mutex_lock(&dc->idle_lock);
+            while (!n && dc->work_gen == gen && __atomic_load_n(&dc->pending, __ATOMIC_ACQUIRE) > 0)
+                pthread_cond_wait(&dc->wake, &dc->idle_lock);
+            __atomic_sub_fetch(&dc->nidle, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&dc->idle_lock);
+            if (!n && __atomic_load_n(&dc->pending, __ATOMIC_ACQUIRE) == 0) break;
+            if (!n) continue;
+        }
+        du_scan(dc, a->self, n, dbuf, dcap);
+        if (__atomic_sub_fetch(&dc->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+            // the walk is done: release everyone parked
+            pthread_mutex_lock(&dc->idle_lock);
+            pthread_cond_broadcast(&dc->wake);
+            pthread_mutex_unlock(&dc->idle_lock);
+        }
+    }
+    free(dbuf);
+    return NULL;
+}
+
+/* du -h: K/M/G... rounded up, one decimal below 10 */
+const char *du_human(uint64_t v, char *buf, size_t n) {
+    if (v < 1024) {
+        snprintf(buf, n, "%" PRIu64, v);
+        return buf;
+    }
+    const char *units = "KMGTPE";
+    uint64_t div = 1024;
+    for (int u = 0;; ++u, div <<= 10) {
+        uint64_t tenths = (v / div) * 10 + ((v % div) * 10 + div - 1) / div;
+        if (tenths < 100) {
+            snprintf(buf, n, "%" PRIu64 ".%" PRIu64 "%c", tenths / 10, tenths % 10, units[u]);
+            break;
+        }
+        uint64_t whole = v / div + (v % div != 0);
+        if (whole < 1024 || !units[u + 1]) {
+            snprintf(buf, n, "%" PRIu64 "%c", whole, units[u]);
+            break;
+        }
+    }
+    return buf;
+}
+
+void du_line(struct du_ctx *dc, struct bstream *out, uint64_t bytes, const char *path, size_t len) {
+    char num[32];
+    if (dc->human) du_human(bytes, num, sizeof(num));
+    else snprintf(num, sizeof(num), "%" PRIu64, (bytes + 1023) / 1024);
+    bs_printf(out, "%s\t", num);
+    bs_write(out, path, len);
+    bs_write(out, "\n", 1);
+}
+
+/* Post-order over the scanned tree in du's order: hard link checks, subtree
+   totals, output lines, frees. A directory already counted (several
+   arguments) is skipped with everything under it. */
+uint64_t du_output(struct du_ctx *dc, struct du_node *root, struct bstream *out) {
+    struct frame { struct du_node *n; int item; size_t plen; int skip; } *st = malloc(64 * sizeof(*st));
+    int depth = 1, cap = 64;
+    struct sbuf path = { 0 };
+    sb_put(&path, root->name, strlen(root->name));
+    st[0] = (struct frame){ root, 0, path.len, 0 };
+    uint64_t total = 0;
+    while (depth > 0) {
+        struct frame *f = &st[depth - 1];
+        struct du_node *n = f->n;
+        if (f->item < n->nitems) {
+            struct du_item *it = &n->items[f->item++];
+            path.len = f->plen;
+            if (path.len && path.buf[path.len - 1] != '/') sb_put(&path, "/", 1);
+            if (!it->dir) {
+                if (!f->skip && (!it->ino || du_seen_add(dc, it->dev, it->ino))) {
+                    if (it->ino) n->bytes += it->bytes;
+                    if (it->name) {
+                        sb_put(&path, it->name, strlen(it->name));
+                        du_line(dc, out, it->bytes, path.buf, path.len);
+                    }
+                }
+                free(it->name);
+                continue;
+            }
+            struct du_node *c = it->dir;
+            sb_put(&path, c->name, strlen(c->name));
+            int skip = f->skip || (dc->hash_all && c->ino && !du_seen_add(dc, c->dev, c->ino));
+            if (depth == cap) st = realloc(st, (cap *= 2) * sizeof(*st));
+            st[depth++] = (struct frame){ c, 0, path.len, skip };
+            continue;
+        }
+        path.len = f->plen;
+        if (!f->skip) {
+            if (n->depth <= dc->maxdepth) du_line(dc, out, n->bytes, path.buf, path.len);
+            if (n->parent) n->parent->bytes += n->bytes;
+            else total = n->bytes;
+        }
+        free(n->items);
+        free(n->name);
+        free(n);
+        depth--;
+    }
+    free(path.buf);
+    free(st);
+    return total;
+}
+
+/* -a -s -c -h -k and -d N / -dN; -1 when the real du is needed */
+int du_parse(char **argv, int argc, int *all, int *sum, int *total, int *human, int *maxdepth) {
+    *all = *sum = *total = *human = 0;
+    *maxdepth = INT_MAX;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; ++i) {
+        for (const char *f = argv[i] + 1; *f; ++f) {
+            if (*f == 'a') *all = 1;
+            else if (*f == 's') *sum = 1;
+            else if (*f == 'c') *total = 1;
+            else if (*f == 'h') *human = 1;
+            else if (*f == 'k') *human = 0;
+            else if (*f == 'd') {
+                const char *v = f[1] ? f + 1 : i + 1 < argc ? argv[++i] : "";
+                if (!*v || strspn(v, "0123456789") != strlen(v)) return -1;
+                *maxdepth = atoi(v);
+                break;
+            } else {
+                return -1;
+            }
+        }
+    }
+    if (*sum && (*all || *maxdepth != INT_MAX)) return -1;     // the real du reports the conflict
+    if (*sum) *maxdepth = 0;
+    for (int j = i; j < argc; ++j)
+        if (argv[j][0] == '-' && argv[j][1] != '\0') return -1;
+    return i;
+}
+
+int builtin_du(char **argv, int argc, struct bstream *in, struct bstream *out) {
+    PROF_FUNC;
+    (void)in;
+    struct du_ctx *dc = calloc(1, sizeof(*dc));
+    int sum, grand;
+    int first = du_parse(argv, argc, &dc->all, &sum, &grand, &dc->human, &dc->maxdepth);
+    char *dot[] = { "." };
+    char **paths = first < argc ? argv + first : dot;
+    int npaths = first < argc ? argc - first : 1;
+    dc->hash_all = npaths > 1;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    dc->nthreads = ncpu < 4 ? 4 : ncpu > DU_MAX_THREADS ? DU_MAX_THREADS : ncpu;
+    for (int i = 0; i < dc->nthreads; ++i) pthread_mutex_init(&dc->dq[i].lock, NULL);
+    pthread_mutex_init(&dc->idle_lock, NULL);
+    pthread_cond_init(&dc->wake, NULL);
+    uint64_t total = 0;
+    for (int i = 0; i < npaths; ++i) {
+        struct statx sx;
+        if (statx(AT_FDCWD, paths[i], AT_SYMLINK_NOFOLLOW, STATX_BLOCKS | STATX_NLINK | STATX_INO | STATX_TYPE, &sx) != 0) {
+            fprintf(stderr, "Invalid Command: %s: %s\n", paths[i], strerror(errno));
+            dc->errors = 1;
+            continue;
+        }
+        uint64_t b = sx.stx_blocks * 512;
+        if ((dc->hash_all || (!S_ISDIR(sx.stx_mode) && sx.stx_nlink > 1)) && !du_seen_add(dc, du_dev(&sx), sx.stx_ino))
+            continue;
+        if (!S_ISDIR(sx.stx_mode)) {
+            du_line(dc, out, b, paths[i], strlen(paths[i]));
+            total += b;
+            continue;
+        }
+        struct du_node *root = calloc(1, sizeof(*root));
+        root->name = strdup(paths[i]);
+        root->fd = -1;
+        root->refs = 1;
+        root->bytes = b;
+        du_push(dc, 0, root);
+        // this thread is worker 0
+        pthread_t th[DU_MAX_THREADS];
+        struct du_worker_arg args[DU_MAX_THREADS];
+        int started = 1;
+        for (; started < dc->nthreads; ++started) {
+            args[started] = (struct du_worker_arg){ dc, started };
+            if (pthread_create(&th[started], NULL, du_worker, &args[started]) != 0) break;
+        }
+        args[0] = (struct du_worker_arg){ dc, 0 };
+        du_worker(&args[0]);
+        for (int k = 1; k < started; ++k) pthread_join(th[k], NULL);
+        total += du_output(dc, root, out);
+    }
+    if (grand) du_line(dc, out, total, "total", 5);
+    int status = dc->errors;
+    for (int i = 0; i < dc->nthreads; ++i) {
+        free(dc->dq[i].q);
+        pthread_mutex_destroy(&dc->dq[i].lock);
+    }
+    pthread_mutex_destroy(&dc->idle_lock);
+    pthread_cond_destroy(&dc->wake);
+    free(dc->seen);
+    free(dc);
+    return status;
+}
+
+/* Builtins are only taken in-shell for the forms they implement, anything
+   else goes to the real tool: echo, cat and cp for their plain forms (any
+   option), sort, grep, wc, head, tail, find and du for what their own
+   option parsers accept */
+int has_option_args(char **argv, int argc) {
+    for (int i = 1; i < argc; ++i) {
+        if (argv[i][0] == '-' && argv[i][1] != '\0') return 1;
+    }
+    return 0;
+}
+
+/* Builtins that can be a pipeline stage; they run on struct bstream */
+int is_stream_builtin(char **argv, int argc) {
+    if (argc == 0) return 0;
+    if (strcmp(argv[0], "echo") == 0) return !has_option_args(argv, argc);
+    if (strcmp(argv[0], "cat") == 0) return !has_option_args(argv, argc) && !perfstat_active;
+    if (strcmp(argv[0], "jobs") == 0) return argc == 1;
+    if (strcmp(argv[0], "sort") == 0) return sort_opts_ok(argv, argc) && !perfstat_active;
+    if (strcmp(argv[0], "grep") == 0) return grep_opts_ok(argv, argc) && !perfstat_active;
+    if (strcmp(argv[0], "wc") == 0) return wc_opts_ok(argv, argc) && !perfstat_active;
+    if (strcmp(argv[0], "du") == 0) {
+        int all, sum, total, human, maxdepth;
+        return du_parse(argv, argc, &all, &sum, &total, &human, &maxdepth) >= 0 && !perfstat_active;
+    }
+    if (strcmp(argv[0], "find") == 0) {
+        // with -exec its batches write to fd 1 themselves: not a channel stage
+        struct find_expr e;
+        return find_parse(argv, argc, &e) >= 0 && e.exec_at < 0 && !perfstat_active;
+    }
+    if (strcmp(argv[0], "head") == 0 || strcmp(argv[0], "tail") == 0) {
+        long long n;
+        int bytes, from_start;
+        return ht_parse(argv, argc, argv[0][0] == 't', &n, &bytes, &from_start) >= 0 && !perfstat_active;
+    }
+    return strcmp(argv[0], "history") == 0 || strcmp(argv[0], "read") == 0;
+}
+
+int run_stream_builtin(char **argv, int argc, struct bstream *in, struct bstream *out) {
+    int status = 0;
+    if (strcmp(argv[0], "echo") == 0) status = builtin_echo(argv, argc, out);
+    else if (strcmp(argv[0], "cat") == 0) status = builtin_cat(argv, argc, in, out);
+    else if (strcmp(argv[0], "read") == 0) status = builtin_read(argv, argc, in);
+    else if (strcmp(argv[0], "jobs") == 0) jobs_list(out);
+    else if (strcmp(argv[0], "sort") == 0) status = builtin_sort(argv, argc, in, out);
+    else if (strcmp(argv[0], "grep") == 0) status = builtin_grep(argv, argc, in, out);
+    else if (strcmp(argv[0], "wc") == 0) status = builtin_wc(argv, argc, in, out);
+    else if (strcmp(argv[0], "find") == 0) status = builtin_find(argv, argc, in, out);
+    else if (strcmp(argv[0], "du") == 0) status = builtin_du(argv, argc, in, out);
+    else if (strcmp(argv[0], "head") == 0 || strcmp(argv[0], "tail") == 0) status = builtin_head_tail(argv, argc, in, out);
+    else do_history(argc > 1 ? atoi(argv[1]) : 0, out);     // 'history n' prints the last n
+    if (!out->ch) bs_flush(out);
+    return status;
+}
+
+/* Background children must not read the terminal the prompt is using */
+void stdin_from_devnull(void) {
+    int nul = open("/dev/null", O_RDONLY);
+    if (nul >= 0) {
+        dup2(nul, STDIN_FILENO);
+        close(nul);
+    }
+}
+
+/* Would the shell exit right after the current command? Not if a job is
+   still to be reported, or the profiler, perfstat or the audit log still
+   have something to write once it has finished. */
+int shell_done_after(void) {
+    if (prof_on || perfstat_active || audit_fd >= 0) return 0;
+    for (int j = 0; j < MAX_JOBS; ++j)
+        if (jobs[j]) return 0;
+    return 1;
+}
+
+/* ---- builtins that run against the shell's own fds ----
+   Their redirections are applied to fds 0 and 1 of the shell itself for the
+   duration of the builtin: the originals are parked on close-on-exec fds
+   above 10 (so no child ever inherits them) and put back afterwards. No fork,
+   and a builtin needs no redirection handling of its own.
+*/
+struct fd_save { int saved[2]; };
+
+/* Point fds 0 and 1 at in_fd / out_fd (-1: leave that fd alone) */
+void fd_redirect(struct fd_save *fs, int in_fd, int out_fd) {
+    int fds[2] = { in_fd, out_fd };
+    for (int k = 0; k < 2; ++k) {
+        fs->saved[k] = -1;
+        if (fds[k] < 0) continue;
+        fs->saved[k] = fcntl(k, F_DUPFD_CLOEXEC, 10);
+        dup2(fds[k], k);
+    }
+}
+
+void fd_restore(struct fd_save *fs) {
+    for (int k = 0; k < 2; ++k) {
+        if (fs->saved[k] < 0) continue;
+        dup2(fs->saved[k], k);
+        close(fs->saved[k]);
+    }
+}
+
+/* 64-bit FNV-1a */
+uint64_t fnv1a(const char *s, size_t n) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < n; ++i) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* The shell's per-user cache directory ($XDG_CACHE_HOME/mtlsh or ~/.cache/mtlsh), created on demand */
+int cache_dir(char *dir, size_t n) {
+    const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    if (xdg && *xdg) snprintf(dir, n, "%s", xdg);
+    else if (home && *home) snprintf(dir, n, "%s/.cache", home);
+    else return -1;
+    mkdir(dir, 0700);
+    strncat(dir, "/mtlsh", n - strlen(dir) - 1);
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) return -1;
+    return 0;
+}
+
+/* ---- command resolution ----
+   Commands are looked up along PATH in the shell, before any fork: a found
+   command is exec'd by its full path, a missing one fails right here with no
+   child at all. Misses are remembered for RESOLVE_NEG_TTL seconds, and all
+   of them are dropped as soon as PATH changes or one of its directories gets
+   a new mtime (a command was installed or removed there). The TTL covers
+   what mtimes do not show, like chmod +x on a file already there.
+*/
+#define RESOLVE_NEG_TTL 5
+#define RESOLVE_BUCKETS 64
+
+struct neg_entry {
+    char name[64];
+    time_t expires;         // CLOCK_MONOTONIC seconds
+    struct neg_entry *next;
+};
+
+static struct neg_entry *neg_cache[RESOLVE_BUCKETS];
+static struct pool neg_pool = POOL_INIT(struct neg_entry);
+static char *path_seen = NULL;      // PATH the snapshot below was taken for
+static int path_ndirs = 0;
+static char **path_dirs = NULL;
+static struct timespec *path_mtimes = NULL;
+
+void neg_flush(void) {
+    for (int b = 0; b < RESOLVE_BUCKETS; ++b) {
+        while (neg_cache[b]) {
+            struct neg_entry *e = neg_cache[b];
+            neg_cache[b] = e->next;
+            pool_free(&neg_pool, e);
+        }
+    }
+}
+
+/* Has PATH, or any directory on it, changed since the last call? */
+int path_changed(void) {
+    const char *path = getenv("PATH");
+    if (!path) path = "/bin:/usr/bin";
+    int changed = 0;
+    if (!path_seen || strcmp(path, path_seen) != 0) {
+        free(path_seen);
+        if (path_dirs) free(path_dirs[0]);     // the split copy of PATH
+        free(path_dirs);
+        free(path_mtimes);
+        path_seen = strdup(path);
+        path_ndirs = 1;
+        for (const char *c = path; *c; ++c) path_ndirs += (*c == ':');
+        path_dirs = malloc(sizeof(char *) * path_ndirs);
+        path_mtimes = calloc(path_ndirs, sizeof(struct timespec));
+        char *copy = strdup(path);
+        for (int i = 0; i < path_ndirs; ++i) {
+            path_dirs[i] = copy;
+            copy = strchrnul(copy, ':');
+            if (*copy) *copy++ = '\0';
+        }
+        changed = 1;
+    }
+    for (int i = 0; i < path_ndirs; ++i) {
+        struct stat st;
+        struct timespec m = { 0, 0 };
+        if (stat(*path_dirs[i] ? path_dirs[i] : ".", &st) == 0) m = st.st_mtim;
+        if (m.tv_sec != path_mtimes[i].tv_sec || m.tv_nsec != path_mtimes[i].tv_nsec) changed = 1;
+        path_mtimes[i] = m;
+    }
+    if (changed) neg_flush();
+    return changed;
+}
+
+/* ---- shared PATH index ----
+   One file per user and PATH value in the cache directory lists every
+   executable of every PATH directory, hashed by name, with the mtime each
+   directory had when it was scanned. Shells map it read-only and look up
+   commands (and complete the first word) in it; only a shell that finds a
+   directory's mtime moved rescans that directory, under an flock, and
+   rewrites the index in place. Readers never lock: the header's sequence
+   number is odd while a rewrite is in progress and changes with every
+   rewrite, so a reader that saw it change retries. A writer that died
+   mid-rewrite leaves seq odd: readers give up waiting after a while and walk
+   PATH, and the next writer rebuilds every directory and makes seq even
+   again. A rewrite that no longer
+   fits builds a bigger file, renames it into place and marks the old one
+   retired, which makes its readers map the new one. The first 64 PATH
+   directories are indexed; resolve_command scans the rest as before.
+*/
+#define PIDX_MAGIC "MTLPX01"
+#define PIDX_MAX_DIRS 64
+#define PIDX_SPIN 1000          // yields a reader waits out a rewrite before walking PATH
+
+struct pidx_header {
+    char magic[8];
+    uint32_t seq;           // seqlock: odd while being rewritten
+    uint32_t retired;       // a newer file has replaced this one
+    uint64_t path_hash;
+    uint64_t cap;           // file size
+    uint32_t ndirs, nnames, nbuckets, strings;  // strings: offset of the name bytes
+    int64_t dir_mtime[PIDX_MAX_DIRS];           // ns; -1: directory missing
+    // then uint32_t buckets[nbuckets] (entry + 1, 0: empty), struct pidx_entry[nnames], names
+};
+
+struct pidx_entry {
+    uint32_t name;          // offset from strings
+    uint32_t next;          // entry + 1 in the same bucket, 0: end
+    uint32_t dir;
+};
+
+static struct pidx_header *pidx = NULL;     // read-only shared mapping
+static size_t pidx_maplen = 0;
+static uint64_t pidx_hash = 0;              // PATH the mapping belongs to
+
+int64_t ts_ns(struct timespec t) {
+    return (int64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+int pidx_file(char *out, size_t n, uint64_t hash) {
+    char dir[PATH_MAX - 32];
+    if (cache_dir(dir, sizeof(dir)) != 0) return -1;
+    snprintf(out, n, "%s/path-%016llx", dir, (unsigned long long)hash);
+    return 0;
+}
+
+void pidx_unmap(void) {
+    if (pidx) munmap(pidx, pidx_maplen);
+    pidx = NULL;
+}
+
+int pidx_map(void) {
+    char file[PATH_MAX];
+    if (pidx_file(file, sizeof(file), pidx_hash) != 0) return -1;
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct pidx_header)) {
+        close(fd);
+        return -1;
+    }
+    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return -1;
+    struct pidx_header *h = m;
+    if (memcmp(h->magic, PIDX_MAGIC, 8) != 0 || h->path_hash != pidx_hash || h->cap != (uint64_t)st.st_size) {
+        munmap(m, st.st_size);
+        return -1;
+    }
+    pidx = h;
+    pidx_maplen = st.st_size;
+    return 0;
+}
+
+/* Executables of one directory, appended to sb as NUL-terminated names */
+int pidx_scan(const char *path, struct sbuf *sb) {
+    int fd = open(*path ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    DIR *d = fdopendir(fd);
+    struct dirent *de;
+    int n = 0;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.' && (de->d_name[1] == '\0' || (de->d_name[1] == '.' && de->d_name[2] == '\0'))) continue;
+        if (de->d_type != DT_REG && de->d_type != DT_LNK && de->d_type != DT_UNKNOWN) continue;
+        struct stat st;
+        if (fstatat(fd, de->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode) || faccessat(fd, de->d_name, X_OK, 0) != 0) continue;
+        sb_put(sb, de->d_name, strlen(de->d_name) + 1);
+        n++;
+    }
+    closedir(d);
+    return n;
+}
+
+/* Lay out an index for the PATH snapshot: directories marked in rescan are
+   read from disk, the others are taken over from the current mapping */
+struct sbuf pidx_build(const int *rescan) {
+    PROF_FUNC;
+    int ndirs = path_ndirs < PIDX_MAX_DIRS ? path_ndirs : PIDX_MAX_DIRS;
+    struct sbuf names = { NULL, 0, 0 };
+    int counts[PIDX_MAX_DIRS];
+    int total = 0;
+    for (int i = 0; i < ndirs; ++i) {
+        counts[i] = 0;
+        if (rescan[i] || !pidx) {
+            counts[i] = pidx_scan(path_dirs[i], &names);
+        } else {
+            // copy the directory's names out of the current index (we hold the lock)
+            struct pidx_entry *ents = (struct pidx_entry *)((uint32_t *)(pidx + 1) + pidx->nbuckets);
+            const char *strs = (const char *)pidx + pidx->strings;
+            for (uint32_t k = 0; k < pidx->nnames; ++k) {
+                if (ents[k].dir != (uint32_t)i) continue;
+                sb_put(&names, strs + ents[k].name, strlen(strs + ents[k].name) + 1);
+                counts[i]++;
+            }
+        }
+        total += counts[i];
+    }
+
+    uint32_t nbuckets = 64;
+    while (nbuckets < (uint32_t)total * 2) nbuckets *= 2;
+    struct pidx_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, PIDX_MAGIC, 8);
+    h.path_hash = pidx_hash;
+    h.ndirs = ndirs;
+    h.nnames = total;
+    h.nbuckets = nbuckets;
+    h.strings = sizeof(h) + nbuckets * sizeof(uint32_t) + total * sizeof(struct pidx_entry);
+    for (int i = 0; i < ndirs; ++i) h.dir_mtime[i] = rescan[i] || !pidx ? ts_ns(path_mtimes[i]) : pidx->dir_mtime[i];
+
+    struct sbuf out = { NULL, 0, 0 };
+    sb_put(&out, (const char *)&h, sizeof(h));
+    uint32_t *buckets = calloc(nbuckets, sizeof(uint32_t));
+    struct pidx_entry *ents = calloc(total ? total : 1, sizeof(struct pidx_entry));
+    const char *nm = names.buf;
+    int k = 0;
+    for (int i = 0; i < ndirs; ++i) {
+        for (int c = 0; c < counts[i]; ++c, ++k) {
+            size_t len = strlen(nm);
+            uint32_t b = fnv1a(nm, len) & (nbuckets - 1);
+            ents[k].name = nm - names.buf;
+            ents[k].dir = i;
+            ents[k].next = buckets[b];
+            buckets[b] = k + 1;
+            nm += len + 1;
+        }
+    }
+    sb_put(&out, (const char *)buckets, nbuckets * sizeof(uint32_t));
+    sb_put(&out, (const char *)ents, total * sizeof(struct pidx_entry));
+    sb_put(&out, names.buf ? names.buf : "", names.len);
+    free(buckets);
+    free(ents);
+    free(names.buf);
+    return out;
+}
+
+/* Bring the shared index up to date with the directory mtimes just taken by path_changed() */
+void pidx_sync(void) {
+    PROF_FUNC;
+    uint64_t hash = fnv1a(path_seen, strlen(path_seen));
+    if (hash != pidx_hash || (pidx && __atomic_load_n(&pidx->retired, __ATOMIC_ACQUIRE))) {
+        pidx_unmap();
+        pidx_hash = hash;
+    }
+    if (!pidx) pidx_map();
+    int ndirs = path_ndirs < PIDX_MAX_DIRS ? path_ndirs : PIDX_MAX_DIRS;
+    // odd here is a rewrite in progress or one that died; the lock tells them apart
+    int rescan[PIDX_MAX_DIRS], stale = !pidx || (__atomic_load_n(&pidx->seq, __ATOMIC_ACQUIRE) & 1);
+    for (int i = 0; i < ndirs; ++i) {
+        int64_t m = path_mtimes[i].tv_sec || path_mtimes[i].tv_nsec ? ts_ns(path_mtimes[i]) : -1;
+        rescan[i] = !pidx || __atomic_load_n(&pidx->dir_mtime[i], __ATOMIC_RELAXED) != m;
+        stale |= rescan[i];
+    }
+    if (!stale) return;
+
+    char file[PATH_MAX], lock[PATH_MAX + 8];
+    if (pidx_file(file, sizeof(file), hash) != 0) return;
+    snprintf(lock, sizeof(lock), "%s.lock", file);
+    int lfd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lfd < 0 || flock(lfd, LOCK_EX) != 0) {
+        if (lfd >= 0) close(lfd);
+        return;
+    }
+    // another shell may have done the work while we waited for the lock
+    pidx_unmap();
+    pidx_map();
+    // under the lock an odd seq means a writer died mid-copy: nothing in the file can be trusted
+    int torn = pidx && (pidx->seq & 1);
+    stale = !pidx || torn;
+    for (int i = 0; i < ndirs; ++i) {
+        int64_t m = path_mtimes[i].tv_sec || path_mtimes[i].tv_nsec ? ts_ns(path_mtimes[i]) : -1;
+        rescan[i] = !pidx || torn || pidx->dir_mtime[i] != m;
+        stale |= rescan[i];
+    }
+    if (stale) {
+        struct sbuf img = pidx_build(rescan);
+        struct pidx_header *nh = (struct pidx_header *)img.buf;
+        for (int i = 0; i < ndirs; ++i)
+            if (rescan[i] && !path_mtimes[i].tv_sec && !path_mtimes[i].tv_nsec) nh->dir_mtime[i] = -1;
+        int fd = pidx ? open(file, O_RDWR | O_CLOEXEC) : -1;
+        struct pidx_header *w = fd >= 0 ? mmap(NULL, pidx_maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        if (w != MAP_FAILED && img.len <= w->cap) {
+            // in place: readers retry while seq is odd or has moved
+            nh->cap = w->cap;
+            __atomic_or_fetch(&w->seq, 1, __ATOMIC_SEQ_CST);     // already odd if torn
+            memcpy((char *)w + offsetof(struct pidx_header, path_hash), img.buf + offsetof(struct pidx_header, path_hash),
+                   img.len - offsetof(struct pidx_header, path_hash));
+            __atomic_add_fetch(&w->seq, 1, __ATOMIC_SEQ_CST);
+        } else {
+            // a new, roomier file; readers of the old one are told to switch
+            nh->cap = img.len * 2 > 65536 ? img.len * 2 : 65536;
+            char tmp[PATH_MAX + 16];
+            snprintf(tmp, sizeof(tmp), "%s.%d", file, (int)getpid());
+            int tfd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            int ok = tfd >= 0 && ftruncate(tfd, nh->cap) == 0 && pwrite(tfd, img.buf, img.len, 0) == (ssize_t)img.len;
+            if (tfd >= 0) close(tfd);
+            if (ok && rename(tmp, file) == 0) {
+                if (w != MAP_FAILED) __atomic_store_n(&w->retired, 1, __ATOMIC_RELEASE);
+            } else {
+                unlink(tmp);
+            }
+        }
+        if (w != MAP_FAILED) munmap(w, pidx_maplen);
+        if (fd >= 0) close(fd);
+        free(img.buf);
+        pidx_unmap();
+        pidx_map();
+    }
+    flock(lfd, LOCK_UN);
+    close(lfd);
+}
+
+/* Wait for an even sequence number into *seq; what is read after it is
+   consistent if it is still current after use. -1 if a rewrite does not
+   finish (its writer may have died), and the caller should not use the index */
+int pidx_begin(uint32_t *seq) {
+    for (int spins = 0; (*seq = __atomic_load_n(&pidx->seq, __ATOMIC_ACQUIRE)) & 1; ++spins) {
+        if (spins == PIDX_SPIN) return -1;
+        sched_yield();
+    }
+    return 0;
+}
+
+int pidx_retry(uint32_t seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&pidx->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/* Index lookup: the directory of the first PATH entry holding name, -1 if none */
+int pidx_find(const char *name) {
+    if (!pidx) return -1;
+    size_t len = strlen(name);
+    uint64_t hv = fnv1a(name, len);
+    int dir;
+    uint32_t seq;
+    do {
+        if (pidx_begin(&seq) != 0) return -1;   // resolve_command walks PATH
+        dir = -1;
+        // a torn read must stay inside the mapping: check every offset against it
+        uint32_t nb = pidx->nbuckets, nn = pidx->nnames, strs = pidx->strings;
+        size_t ents_off = sizeof(*pidx) + (size_t)nb * sizeof(uint32_t);
+        if (nb == 0 || (nb & (nb - 1)) || ents_off + (size_t)nn * sizeof(struct pidx_entry) > pidx_maplen || strs > pidx_maplen) continue;
+        uint32_t *buckets = (uint32_t *)(pidx + 1);
+        struct pidx_entry *ents = (struct pidx_entry *)((char *)pidx + ents_off);
+        uint32_t k = buckets[hv & (nb - 1)];
+        for (uint32_t steps = 0; k && k <= nn && steps <= nn; k = ents[k - 1].next, ++steps) {
+            struct pidx_entry *e = &ents[k - 1];
+            if ((size_t)strs + e->name + len + 1 > pidx_maplen) break;
+            const char *nm = (const char *)pidx + strs + e->name;
+            if (memcmp(nm, name, len + 1) == 0 && (dir < 0 || (int)e->dir < dir)) dir = e->dir;
+        }
+    } while (pidx_retry(seq));
+    return dir < path_ndirs ? dir : -1;
+}
+
+/* Commands starting with prefix: how many (0, 1 or 2 for "several"), the one into out */
+int pidx_complete(const char *prefix, char *out, size_t n) {
+    path_changed();
+    pidx_sync();
+    if (!pidx) return 0;
+    size_t plen = strlen(prefix);
+    int found;
+    uint32_t seq;
+    do {
+        if (pidx_begin(&seq) != 0) return 0;
+        found = 0;
+        uint32_t nn = pidx->nnames, strs = pidx->strings;
+        size_t ents_off = sizeof(*pidx) + (size_t)pidx->nbuckets * sizeof(uint32_t);
+        if (ents_off + (size_t)nn * sizeof(struct pidx_entry) > pidx_maplen || strs > pidx_maplen) continue;
+        struct pidx_entry *ents = (struct pidx_entry *)((char *)pidx + ents_off);
+        for (uint32_t k = 0; k < nn && found < 2; ++k) {
+            size_t off = (size_t)strs + ents[k].name;
+            if (off >= pidx_maplen) break;
+            const char *nm = (const char *)pidx + off;
+            if (strnlen(nm, pidx_maplen - off) == pidx_maplen - off || strncmp(nm, prefix, plen) != 0) continue;
+            if (found == 1 && strcmp(nm, out) == 0) continue;   // same name in another directory
+            if (found == 0) snprintf(out, n, "%s", nm);
+            found++;
+        }
+    } while (pidx_retry(seq));
+    return found;
+}
+
+time_t mono_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/* Full path of the command name into out; -1 if it is not on PATH */
+int resolve_command(const char *name, char *out, size_t n) {
+    PROF_FUNC;
+    if (strchr(name, '/')) {
+        snprintf(out, n, "%s", name);
+        return 0;
+    }
+    size_t len = strlen(name);
+    int changed = path_changed();
+    pidx_sync();
+    int dir = pidx_find(name);
+    if (dir >= 0) {
+        snprintf(out, n, "%s/%s", *path_dirs[dir] ? path_dirs[dir] : ".", name);
+        return 0;
+    }
+    struct neg_entry **slot = &neg_cache[fnv1a(name, len) % RESOLVE_BUCKETS], *e;
+    for (e = *slot; e && strcmp(e->name, name) != 0; e = e->next) {}
+    if (!changed && e && e->expires > mono_seconds()) return -1;
+    for (int i = 0; i < path_ndirs; ++i) {
+        struct stat st;
+        snprintf(out, n, "%s/%s", *path_dirs[i] ? path_dirs[i] : ".", name);
+        if (stat(out, &st) == 0 && S_ISREG(st.st_mode) && access(out, X_OK) == 0) return 0;
+    }
+    if (len < sizeof(e->name)) {
+        if (!e) {
+            e = pool_alloc(&neg_pool);
+            memcpy(e->name, name, len + 1);
+            e->next = *slot;
+            *slot = e;
+        }
+        e->expires = mono_seconds() + RESOLVE_NEG_TTL;
+    }
+    return -1;
+}
+
+/* Every name the shell may run itself, in any position */
+static const char *shell_builtins[] = { "cd", "exit", "profile", "jobs", "mux", "source", ".", "command",
+                                        "echo", "cat", "cp", "sort", "grep", "wc", "head", "tail", "find", "du",
+                                        "read", "history", "perfstat", "while", NULL };
+
+int is_shell_builtin(const char *name) {
+    for (int k = 0; shell_builtins[k]; ++k)
+        if (strcmp(shell_builtins[k], name) == 0) return 1;
+    return 0;
+}
+
+/* 'command -v name...': print where each name resolves; 1 if any does not */
+int builtin_command(char **argv, int argc) {
+    if (argc < 3 || strcmp(argv[1], "-v") != 0) {
+        fprintf(stderr, "Invalid Command\n");
+        return 1;
+    }
+    int status = 0;
+    for (int i = 2; i < argc; ++i) {
+        char path[PATH_MAX];
+        if (is_shell_builtin(argv[i])) printf("%s\n", argv[i]);
+        else if (resolve_command(argv[i], path, sizeof(path)) == 0) printf("%s\n", path);
+        else status = 1;
+    }
+    return status;
+}
+
+int source_script(const char *path);
+
+int is_builtin(char **argv, int argc) {
+    static const char *names[] = { "cd", "exit", "profile", "jobs", "mux", "source", ".", "command", NULL };
+    for (int i = 0; names[i]; ++i)
+        if (strcmp(argv[0], names[i]) == 0) return 1;
+    if (strcmp(argv[0], "find") == 0) {
+        struct find_expr e;
+        return find_parse(argv, argc, &e) >= 0 && e.exec_at >= 0 && !perfstat_active;
+    }
+    return strcmp(argv[0], "cp") == 0 && !has_option_args(argv, argc) && !perfstat_active;
+}
+
+int run_builtin(char **argv, int argc) {
+    if (strcmp(argv[0], "cd") == 0) {
+        if (argc < 2) {
+            fprintf(stderr, "Invalid Command\n");
+            return 1;
+        }
+        if (chdir(argv[1]) != 0) {
+            perror("Invalid Command");
+            return 1;
+        }
+        return 0;
+    } else if (strcmp(argv[0], "exit") == 0) {
+        // free history
+        for (int i = 0; i < hist_count; ++i) free(history[i]);
+        exit(argc > 1 ? atoi(argv[1]) : last_status);
+    } else if (strcmp(argv[0], "profile") == 0) {
+        if (argc == 2 && strcmp(argv[1], "on") == 0) prof_start();
+        else if (argc == 2 && strcmp(argv[1], "off") == 0) prof_stop();
+        else if (argc == 2 && strcmp(argv[1], "report") == 0) prof_report(STDOUT_FILENO);
+        else {
+            fprintf(stderr, "Invalid Command\n");
+            return 1;
+        }
+        return 0;
+    } else if (strcmp(argv[0], "jobs") == 0) {
+        return builtin_jobs(argv, argc, STDOUT_FILENO);
+    } else if (strcmp(argv[0], "mux") == 0) {
+        return builtin_mux(argv, argc, STDOUT_FILENO);
+    } else if (strcmp(argv[0], "source") == 0 || strcmp(argv[0], ".") == 0) {
+        if (argc != 2) {
+            fprintf(stderr, "Invalid Command\n");
+            return 1;
+        }
+        return source_script(argv[1]);
+    } else if (strcmp(argv[0], "command") == 0) {
+        return builtin_command(argv, argc);
+    } else if (strcmp(argv[0], "find") == 0) {
+        struct bstream in = { STDIN_FILENO, NULL, NULL, 0 }, out = { STDOUT_FILENO, NULL, NULL, 0 };
+        return builtin_find(argv, argc, &in, &out);
+    }
+    return builtin_cp(argv, argc);
+}
+
+/* Execute non-piped command with optional redirection. Returns exit status (0 on success) */
+int execute_command(char **argv, int argc, int redirect_in_fd, int redirect_out_fd, int append_out) {
+    PROF_FUNC;
+    if (argc == 0) return 0;
+
+    // Built-ins: echo, read, cat, history, jobs (stream builtins), cd, exit, cp, profile, mux
+    if (is_stream_builtin(argv, argc)) {
+        struct bstream in = { redirect_in_fd >= 0 ? redirect_in_fd : STDIN_FILENO, NULL, NULL, 0 };
+        struct bstream out = { redirect_out_fd >= 0 ? redirect_out_fd : STDOUT_FILENO, NULL, NULL, 0 };
+        return run_stream_builtin(argv, argc, &in, &out);
+    }
+    // stream builtins leave fd 1 output in stdio; everything below writes to fd 1 directly
+    fflush(stdout);
+    if (is_builtin(argv, argc)) {
+        // the builtin sees its redirections as the shell's own fds 0 and 1
+        struct fd_save fs;
+        rd_sync();
+        fd_redirect(&fs, redirect_in_fd, redirect_out_fd);
+        // a redirected fd 0 gets its own read-ahead buffer ('source f < in' may read)
+        struct rd_buf *outer = rd_in, *own = NULL;
+        if (redirect_in_fd >= 0) {
+            own = malloc(sizeof(*own));
+            rd_init(own, STDIN_FILENO);
+            rd_in = own;
+        }
+        int status = run_builtin(argv, argc);
+        free(own);
+        rd_in = outer;
+        fflush(stdout);
+        fd_restore(&fs);
+        return status;
+    }
+
+    char path[PATH_MAX];
+    if (resolve_command(argv[0], path, sizeof(path)) != 0) {
+        // not on PATH: no child to find that out
+        fprintf(stderr, "Invalid Command\n");
+        return 127;
+    }
+    if (exec_in_place && !launch_background && shell_done_after()) {
+        // last command of -c / a script: become it instead of fork + wait
+        rd_sync();
+        if (redirect_in_fd >= 0) dup2(redirect_in_fd, STDIN_FILENO);
+        if (redirect_out_fd >= 0) dup2(redirect_out_fd, STDOUT_FILENO);
+        execv(path, argv);
+        fprintf(stderr, "Invalid Command\n");
+        exit(127);
+    }
+    if (launch_background && redirect_out_fd < 0) mux_open();
+    rd_sync();
+    struct perf_gate gate;
+    perf_gate_open(&gate);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Invalid Command");
+        mux_abandon();
+        return 1;
+    } else if (pid == 0) {
+        // child
+        perf_gate_wait(&gate);
+        if (redirect_in_fd >= 0) {
+            dup2(redirect_in_fd, STDIN_FILENO);
+            close(redirect_in_fd);
+        } else if (launch_background) {
+            stdin_from_devnull();
+        }
+        if (redirect_out_fd >= 0) {
+            dup2(redirect_out_fd, STDOUT_FILENO);
+            close(redirect_out_fd);
+        } else if (mux_pending) {
+            dup2(mux_pending->wfd, STDOUT_FILENO);
+        }
+        execv(path, argv);
+        // If exec fails:
+        fprintf(stderr, "Invalid Command\n");
+        _exit(127);
+    } else {
+        int status;
+        perf_gate_attach(&gate, pid);
+        job_stages[0].pid = pid;
+        if (launch_background) {
+            job_stages[0].status = -1;
+            job_nstages = 1;
+            return 0;
+        }
+        wait4(pid, &status, 0, &job_stages[0].ru);
+        clock_gettime(CLOCK_MONOTONIC, &job_stages[0].end);
+        job_stages[0].status = status;
+        job_nstages = 1;
+        perf_gate_collect(&gate);
+        if (WIFEXITED(status)) return WEXITSTATUS(status);
+        return 1;
+    }
+}
+
+/* In a forked child: become argv, or run it there if it is a stream builtin */
+void exec_stage(char **argv, int argc) {
+    if (is_stream_builtin(argv, argc)) {
+        rd_in = &stdin_rd;
+        rd_init(rd_in, STDIN_FILENO);
+        struct bstream in = { STDIN_FILENO, NULL, NULL, 0 }, out = { STDOUT_FILENO, NULL, NULL, 0 };
+        int st = run_stream_builtin(argv, argc, &in, &out);
+        fflush(stdout);
+        _exit(st);
+    }
+    execvp(argv[0], argv);
+    fprintf(stderr, "Invalid Command\n");
+    _exit(127);
+}
+
+/* Execute pipeline of two commands: left | right. Both cmds are argv arrays.
+   Stream builtins run inside the shell: two of them as a coroutine pipeline,
+   one of them against the kernel pipe to the other side's child. */
+int execute_pipe(char **left_argv, int left_argc, char **right_argv, int right_argc, char *right_loop) {
+    PROF_FUNC;
+    int left_here = !launch_background && is_stream_builtin(left_argv, left_argc);
+    int right_here = !launch_background && !right_loop && is_stream_builtin(right_argv, right_argc);
+    if (left_here && right_here) {
+        char **argvs[2] = { left_argv, right_argv };
+        int argcs[2] = { left_argc, right_argc };
+        return coro_pipeline(argvs, argcs, 2);
     }
 
-    pid_t p2 = fork();
-    if (p2 < 0) {
+    int pipefd[2];
+    if (pipe(pipefd) == -1) {
         perror("Invalid Command");
         return 1;
     }
-    if (p2 == 0) {
-        // right child: read end -> stdin
-        dup2(pipefd[0], STDIN_FILENO);
-        close(pipefd[0]); close(pipefd[1]);
-        execvp(right_argv[0], right_argv);
-        fprintf(stderr, "Invalid Command\n");
-        _exit(127);
+
+    if (launch_background) mux_open();
+    rd_sync();
+    fflush(stdout);
+    struct perf_gate gate1, gate2;
+    pid_t p1 = 0, p2 = 0;
+    if (!left_here) {
+        perf_gate_open(&gate1);
+        p1 = fork();
+        if (p1 < 0) {
+            perror("Invalid Command");
+            mux_abandon();
+            return 1;
+        }
+        if (p1 == 0) {
+            // left child: write end -> stdout
+            perf_gate_wait(&gate1);
+            if (launch_background) stdin_from_devnull();
+            dup2(pipefd[1], STDOUT_FILENO);
+            close(pipefd[0]); close(pipefd[1]);
+            exec_stage(left_argv, left_argc);
+        }
+        perf_gate_attach(&gate1, p1);
+    }
+
+    if (!right_here) {
+        perf_gate_open(&gate2);
+        p2 = fork();
+        if (p2 < 0) {
+            perror("Invalid Command");
+            mux_abandon();
+            return 1;
+        }
+        if (p2 == 0) {
+            // right child: read end -> stdin
+            perf_gate_wait(&gate2);
+            dup2(pipefd[0], STDIN_FILENO);
+            if (mux_pending) dup2(mux_pending->wfd, STDOUT_FILENO);
+            close(pipefd[0]); close(pipefd[1]);
+            if (right_loop) {
+                // this copy of the shell is the only reader of the pipe
+                mux_mode = MUX_OFF;
+                rd_in = &stdin_rd;
+                rd_init(rd_in, STDIN_FILENO);
+                audit_after_fork();
+                int st = run_while(right_loop);
+                fflush(stdout);
+                audit_shutdown();
+                _exit(st);
+            }
+            exec_stage(right_argv, right_argc);
+        }
+        perf_gate_attach(&gate2, p2);
     }
 
     // parent
-    close(pipefd[0]); close(pipefd[1]);
-    int status1, status2;
-    waitpid(p1, &status1, 0);
-    waitpid(p2, &status2, 0);
+    int status1 = 0, status2 = 0;
+    if (left_here || right_here) {
+        // the builtin side runs here on its end of the pipe
+        int fd = left_here ? pipefd[1] : pipefd[0];
+        close(left_here ? pipefd[0] : pipefd[1]);
+        struct bstream in = { right_here ? fd : STDIN_FILENO, NULL, NULL, 0 };
+        struct bstream out = { left_here ? fd : STDOUT_FILENO, NULL, NULL, 0 };
+        int st = left_here ? run_here(left_argv, left_argc, &in, &out) : run_here(right_argv, right_argc, &in, &out);
+        close(fd);
+        struct stage_result *sr = &job_stages[left_here ? 0 : 1];
+        memset(&sr->ru, 0, sizeof(sr->ru));
+        clock_gettime(CLOCK_MONOTONIC, &sr->end);
+        if (left_here) status1 = W_EXITCODE(st, 0);
+        else status2 = W_EXITCODE(st, 0);
+    } else {
+        close(pipefd[0]); close(pipefd[1]);
+    }
+    job_stages[0].pid = p1;     // 0: ran in the shell
+    job_stages[1].pid = p2;
+    if (launch_background) {
+        job_stages[0].status = job_stages[1].status = -1;
+        job_nstages = 2;
+        return 0;
+    }
+    if (p1) {
+        wait4(p1, &status1, 0, &job_stages[0].ru);
+        clock_gettime(CLOCK_MONOTONIC, &job_stages[0].end);
+        perf_gate_collect(&gate1);
+    }
+    if (p2) {
+        wait4(p2, &status2, 0, &job_stages[1].ru);
+        clock_gettime(CLOCK_MONOTONIC, &job_stages[1].end);
+        perf_gate_collect(&gate2);
+    }
+    job_stages[0].status = status1;
+    job_stages[1].status = status2;
+    job_nstages = 2;
     if (WIFEXITED(status2)) return WEXITSTATUS(status2);
     return 1;
 }
@@ -252,89 +5661,238 @@ int execute_pipe(char **left_argv, int left_argc, char **right_argv, int right_a
 /* Parse a single simple command (no pipes) for redirection. Returns 0 on success, fills argv_out & out_argc */
 int parse_redirection_and_build_args(char *cmd, char ***argv_out, int *out_argc,
                                      int *in_fd, int *out_fd, int *append_flag) {
-    // We'll tokenise, then detect <, >, >>
-    char *copy = strdup(cmd);
-    char *tokens[MAXARGS];
-    int tcount = 0;
-    char *p = copy;
-    // naive split by whitespace but keep quoted handled by tokenize_args
-    char *argv_tmp[MAXARGS];
-    int argc_tmp = tokenize_args(copy, argv_tmp);
+    PROF_FUNC;
+    // We'll tokenise, then detect <, >, >> (all of it lives in the line arena)
+    char *argv_tmp[MAXARGS + 1];
+    int argc_tmp = tokenize_args(cmd, argv_tmp);
 
     // prepare default fds
     *in_fd = -1; *out_fd = -1; *append_flag = 0;
 
-    // Scan for redirection tokens
-    char **final_args = malloc(sizeof(char*)*(argc_tmp+1));
+    // Scan for redirection tokens; the target files are opened together afterwards
+    char **final_args = line_alloc(sizeof(char*)*(argc_tmp+1));
     int final_count = 0;
+    struct open_req reqs[MAXARGS / 2 + 1];
+    int nreqs = 0, in_req = -1, out_req = -1;
     int i = 0;
     while (i < argc_tmp) {
-        if (strcmp(argv_tmp[i], "<") == 0) {
-            if (i+1 >= argc_tmp) {
-                free(copy);
-                free_argv(argv_tmp, argc_tmp);
-                free(final_args);
-                return -1;
-            }
-            int fd = open(argv_tmp[i+1], O_RDONLY);
-            if (fd < 0) {
-                // file open error
-                free(copy);
-                free_argv(argv_tmp, argc_tmp);
-                free(final_args);
-                return -2;
-            }
-            *in_fd = fd;
-            i += 2;
-        } else if (strcmp(argv_tmp[i], ">") == 0 || strcmp(argv_tmp[i], ">>") == 0) {
-            int isappend = (strcmp(argv_tmp[i], ">>") == 0);
-            if (i+1 >= argc_tmp) {
-                free(copy);
-                free_argv(argv_tmp, argc_tmp);
-                free(final_args);
-                return -1;
-            }
-            int fd;
-            if (isappend) {
-                fd = open(argv_tmp[i+1], O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (strcmp(argv_tmp[i], "<") == 0 || strcmp(argv_tmp[i], ">") == 0 || strcmp(argv_tmp[i], ">>") == 0) {
+            if (i+1 >= argc_tmp) return -1;
+            struct open_req *r = &reqs[nreqs];
+            r->path = unquoted(argv_tmp[i+1]);
+            r->mode = 0644;
+            if (argv_tmp[i][0] == '<') {
+                r->flags = O_RDONLY;
+                in_req = nreqs;
+            } else if (argv_tmp[i][1] == '>') {
+                r->flags = O_WRONLY | O_CREAT | O_APPEND;
+                out_req = nreqs;
+                *append_flag = 1;
             } else {
-                fd = open(argv_tmp[i+1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                r->flags = O_WRONLY | O_CREAT | O_TRUNC;
+                out_req = nreqs;
+                *append_flag = 0;
             }
-            if (fd < 0) {
-                free(copy);
-                free_argv(argv_tmp, argc_tmp);
-                free(final_args);
-                return -2;
-            }
-            *out_fd = fd;
-            *append_flag = isappend;
+            nreqs++;
             i += 2;
         } else {
-            final_args[final_count++] = strdup(argv_tmp[i]);
+            final_args[final_count++] = argv_tmp[i];
             i++;
         }
     }
     final_args[final_count] = NULL;
 
+    if (nreqs > 0 && io_open_batch(reqs, nreqs) != 0) {
+        // file open error
+        return -2;
+    }
+    for (int k = 0; k < nreqs; ++k) {
+        if (k == in_req) *in_fd = reqs[k].fd;
+        else if (k == out_req) *out_fd = reqs[k].fd;
+        else close(reqs[k].fd); // overridden by a later redirection of the same stream
+    }
+
     // expand wildcards
     int expanded_count;
     char **expanded = expand_wildcards(final_args, final_count, &expanded_count);
 
-    // cleanup
-    free(copy);
-    free_argv(argv_tmp, argc_tmp);
-    for (int k = 0; k < final_count; ++k) free(final_args[k]);
-    free(final_args);
-
     *argv_out = expanded;
     *out_argc = expanded_count;
     return 0;
 }
 
+/* ---- speculative prefetch: MTL458_PREFETCH=1 ----
+   While a line is being typed, the first word is resolved as soon as it is
+   complete (a space typed after it, or Tab completing it). A background
+   thread then pulls the binary into the page cache with readahead (or
+   posix_fadvise WILLNEED where the filesystem has no readahead), follows
+   PT_INTERP and the DT_NEEDED entries of its dynamic section, and does the
+   same for every library found, so a cold binary on a slow mount is warm
+   by the time Enter is pressed. Requests go through a small ring like the
+   audit log's; the thread is started on the first one.
+*/
+#define PREFETCH_RING 8
+#define PREFETCH_MAX_FILES 64
+#define PREFETCH_PATH 1024
+
+static char *prefetch_ring[PREFETCH_RING];
+static unsigned prefetch_head = 0, prefetch_tail = 0;  // head: shell, tail: prefetch thread
+static int prefetch_seq = 0;                           // futex word, bumped on every push
+static int prefetch_waiting = 0;
+static int prefetch_state = -1;     // -1: MTL458_PREFETCH not read yet, 0: off, 1: on, 2: thread running
+static pthread_t prefetch_thread;
+
+/* Library search path of one object: its DT_RUNPATH/DT_RPATH, then the defaults */
+void prefetch_lib_path(const char *lib, const char *runpath, char *out, size_t n) {
+    static const char *dirs[] = { "/lib/x86_64-linux-gnu", "/usr/lib/x86_64-linux-gnu", "/lib64",
+                                  "/usr/lib64", "/lib", "/usr/lib", "/usr/local/lib", NULL };
+    out[0] = '\0';
+    if (strchr(lib, '/')) {
+        snprintf(out, n, "%s", lib);
+        return;
+    }
+    const char *env = getenv("LD_LIBRARY_PATH");
+    const char *lists[2] = { runpath, env };
+    for (int l = 0; l < 2; ++l) {
+        for (const char *d = lists[l]; d && *d; ) {
+            const char *e = strchrnul(d, ':');
+            snprintf(out, n, "%.*s/%s", (int)(e - d), d, lib);
+            if (e > d && *d != '$' && access(out, R_OK) == 0) return;
+            d = *e ? e + 1 : e;
+        }
+    }
+    for (int i = 0; dirs[i]; ++i) {
+        snprintf(out, n, "%s/%s", dirs[i], lib);
+        if (access(out, R_OK) == 0) return;
+    }
+    out[0] = '\0';
+}
+
+/* Map a virtual address of the object to its file offset through the PT_LOAD headers */
+off_t prefetch_vaddr_off(Elf64_Phdr *ph, int n, Elf64_Addr va) {
+    for (int i = 0; i < n; ++i)
+        if (ph[i].p_type == PT_LOAD && va >= ph[i].p_vaddr && va < ph[i].p_vaddr + ph[i].p_filesz)
+            return va - ph[i].p_vaddr + ph[i].p_offset;
+    return -1;
+}
+
+/* Warm one file; append the objects it loads (interpreter, DT_NEEDED) to files */
+void prefetch_file(const char *path, char files[][PREFETCH_PATH], int *nfiles) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0) return;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return;
+    }
+    if (readahead(fd, 0, st.st_size) != 0) posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+
+    Elf64_Ehdr eh;
+    Elf64_Phdr ph[64];
+    if (pread(fd, &eh, sizeof(eh), 0) != sizeof(eh) || memcmp(eh.e_ident, ELFMAG, SELFMAG) != 0
+        || eh.e_ident[EI_CLASS] != ELFCLASS64 || eh.e_phentsize != sizeof(Elf64_Phdr) || eh.e_phnum > 64
+        || pread(fd, ph, eh.e_phnum * sizeof(Elf64_Phdr), eh.e_phoff) != (ssize_t)(eh.e_phnum * sizeof(Elf64_Phdr))) {
+        close(fd);
+        return;
+    }
+    char names[PREFETCH_MAX_FILES][PREFETCH_PATH];
+    int nnames = 0;
+    for (int i = 0; i < eh.e_phnum; ++i) {
+        if (ph[i].p_type == PT_INTERP && ph[i].p_filesz < sizeof(names[0]) && nnames < PREFETCH_MAX_FILES) {
+            if (pread(fd, names[nnames], ph[i].p_filesz, ph[i].p_offset) == (ssize_t)ph[i].p_filesz) {
+                names[nnames][ph[i].p_filesz] = '\0';
+                nnames++;
+            }
+        }
+        if (ph[i].p_type != PT_DYNAMIC || ph[i].p_filesz > 64 * 1024) continue;
+        Elf64_Dyn *dyn = malloc(ph[i].p_filesz);
+        size_t ndyn = ph[i].p_filesz / sizeof(Elf64_Dyn);
+        if (pread(fd, dyn, ph[i].p_filesz, ph[i].p_offset) != (ssize_t)ph[i].p_filesz) ndyn = 0;
+        Elf64_Addr strtab = 0;
+        long runpath = -1;
+        for (size_t k = 0; k < ndyn && dyn[k].d_tag != DT_NULL; ++k) {
+            if (dyn[k].d_tag == DT_STRTAB) strtab = dyn[k].d_un.d_ptr;
+            if (dyn[k].d_tag == DT_RUNPATH || dyn[k].d_tag == DT_RPATH) runpath = dyn[k].d_un.d_val;
+        }
+        off_t stroff = strtab ? prefetch_vaddr_off(ph, eh.e_phnum, strtab) : -1;
+        char rp[PATH_MAX] = "";
+        if (stroff >= 0 && runpath >= 0 && pread(fd, rp, sizeof(rp) - 1, stroff + runpath) > 0) rp[sizeof(rp) - 1] = '\0';
+        for (size_t k = 0; stroff >= 0 && k < ndyn && dyn[k].d_tag != DT_NULL; ++k) {
+            if (dyn[k].d_tag != DT_NEEDED || nnames >= PREFETCH_MAX_FILES) continue;
+            char lib[256];
+            ssize_t r = pread(fd, lib, sizeof(lib) - 1, stroff + dyn[k].d_un.d_val);
+            if (r <= 0) continue;
+            lib[r] = '\0';
+            prefetch_lib_path(lib, rp, names[nnames], sizeof(names[0]));
+            if (names[nnames][0]) nnames++;
+        }
+        free(dyn);
+    }
+    close(fd);
+    // queue what is not queued yet; the caller works through the list
+    for (int i = 0; i < nnames; ++i) {
+        int k = 0;
+        while (k < *nfiles && strcmp(files[k], names[i]) != 0) k++;
+        if (k == *nfiles && *nfiles < PREFETCH_MAX_FILES) memcpy(files[(*nfiles)++], names[i], PREFETCH_PATH);
+    }
+}
+
+void *prefetch_loop(void *arg) {
+    (void)arg;
+    static char files[PREFETCH_MAX_FILES][PREFETCH_PATH];
+    while (1) {
+        unsigned tail = prefetch_tail;
+        if (tail != __atomic_load_n(&prefetch_head, __ATOMIC_ACQUIRE)) {
+            char *path = prefetch_ring[tail % PREFETCH_RING];
+            __atomic_store_n(&prefetch_tail, tail + 1, __ATOMIC_RELEASE);
+            int nfiles = 1;
+            snprintf(files[0], PREFETCH_PATH, "%s", path);
+            free(path);
+            for (int i = 0; i < nfiles; ++i) prefetch_file(files[i], files, &nfiles);
+            continue;
+        }
+        int seq = __atomic_load_n(&prefetch_seq, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&prefetch_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&prefetch_head, __ATOMIC_SEQ_CST) == tail)
+            syscall(SYS_futex, &prefetch_seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+        __atomic_store_n(&prefetch_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+/* Ask for the command word to be warmed up (no-op unless MTL458_PREFETCH=1) */
+void prefetch_command(const char *word) {
+    static char last[PATH_MAX];
+    if (prefetch_state < 0) {
+        const char *env = getenv("MTL458_PREFETCH");
+        prefetch_state = env && strcmp(env, "1") == 0;
+    }
+    if (prefetch_state == 0 || *word == '\0') return;
+    char path[PATH_MAX];
+    if (resolve_command(word, path, sizeof(path)) != 0 || strcmp(path, last) == 0) return;
+    if (prefetch_state == 1) {
+        if (pthread_create(&prefetch_thread, NULL, prefetch_loop, NULL) != 0) {
+            prefetch_state = 0;
+            return;
+        }
+        pthread_detach(prefetch_thread);
+        prefetch_state = 2;
+    }
+    unsigned head = prefetch_head;
+    if (head - __atomic_load_n(&prefetch_tail, __ATOMIC_ACQUIRE) >= PREFETCH_RING) return;
+    snprintf(last, sizeof(last), "%s", path);
+    prefetch_ring[head % PREFETCH_RING] = strdup(path);
+    __atomic_store_n(&prefetch_head, head + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&prefetch_seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&prefetch_waiting, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &prefetch_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
 /* Read a line with basic line-editing and Tab completion.
    Tab completion: completes the current token if exactly one match exists.
 */
 char *read_line_with_tab() {
+    PROF_FUNC;
     struct termios orig_tio, raw_tio;
     tcgetattr(STDIN_FILENO, &orig_tio);
     raw_tio = orig_tio;
@@ -348,8 +5906,13 @@ char *read_line_with_tab() {
     fflush(stdout);
 
     while (1) {
-        int c = getchar();
-        if (c == EOF) {
+        int c = rd_getc(&stdin_rd);
+        if (c == EOF && len == 0) {
+            // end of input: the shell exits like 'exit'
+            putchar('\n');
+            tcsetattr(STDIN_FILENO, TCSANOW, &orig_tio);
+            return NULL;
+        } else if (c == EOF) {
             buf[len] = '\0';
             putchar('\n');
             break;
@@ -375,6 +5938,22 @@ char *read_line_with_tab() {
             strncpy(prefix, buf + start, plen);
             prefix[plen] = '\0';
 
+            // the first word completes to a command, from the PATH index
+            char cmd[256];
+            if (start == 0 && !strchr(prefix, '/') && pidx_complete(prefix, cmd, sizeof(cmd)) == 1) {
+                int addlen = strlen(cmd) - plen;
+                if (len + addlen < MAXLINE - 2) {
+                    memcpy(buf + len, cmd + plen, addlen);
+                    len += addlen;
+                    buf[len++] = ' ';
+                    buf[len] = '\0';
+                    printf("%s ", cmd + plen);
+                    fflush(stdout);
+                    prefetch_command(cmd);
+                }
+                continue;
+            }
+
             // Use glob to find matches for prefix*
             char pattern[1024];
             snprintf(pattern, sizeof(pattern), "%s*", prefix);
@@ -393,6 +5972,7 @@ char *read_line_with_tab() {
                     printf("%s", match + plen);
                     fflush(stdout);
                 }
+                if (start == 0) prefetch_command(buf);
             } else {
                 // multiple or zero matches: do nothing (could show list, but assignment not require)
             }
@@ -403,57 +5983,457 @@ char *read_line_with_tab() {
                 putchar(c);
                 fflush(stdout);
             }
+            // the first word was just completed by a blank: warm up its binary
+            if (isspace(c) && len > 1 && !isspace((unsigned char)buf[len - 2]) && strcspn(buf, " \t") == (size_t)len - 1) {
+                buf[len - 1] = '\0';
+                prefetch_command(buf);
+                buf[len - 1] = (char)c;
+            }
         }
     }
 
     tcsetattr(STDIN_FILENO, TCSANOW, &orig_tio);
-    return strdup(buf);
+    return line_strdup(buf);
+}
+
+/* ---- while loops: 'while cond; do body; done [< in] [> out]' ----
+   A loop stays one piece through split_by_separators (separators between
+   'while' and its 'done' are not split), and may be the right-hand side of a
+   pipe, where it runs in a forked copy of the shell reading the pipe. Each
+   iteration runs cond and body as ordinary command lists; what they allocate
+   in the line arena is rolled back after every iteration.
+*/
+int run_list(char *line);
+int run_pieces(char **pieces, int *sep_types, int piece_count);
+char **split_by_separators(char *line, int *count, int **sep_types);
+
+/* Is the keyword kw a whole word at p (s is the start of the text)? */
+int kw_at(const char *s, const char *p, const char *kw) {
+    if (*p != *kw) return 0;
+    size_t n = strlen(kw);
+    if (strncmp(p, kw, n) != 0) return 0;
+    if (p > s && !strchr(" \t;|&(", p[-1])) return 0;
+    return p[n] == '\0' || strchr(" \t;|&<>)", p[n]) != NULL;
+}
+
+/* Track while/done and ( ) nesting and "quotes" while scanning; returns 1 if p is inside any */
+int nested_at(const char *s, const char *p, int *depth, int *quoted) {
+    if (*p == '"') *quoted = !*quoted;
+    if (*quoted) return 1;
+    if (*p == '(' || kw_at(s, p, "while")) (*depth)++;
+    else if (*depth > 0 && (*p == ')' || kw_at(s, p, "done"))) (*depth)--;
+    return *depth > 0;
+}
+
+/* First '|' of the piece that is not inside a loop or quotes */
+char *find_top_pipe(char *piece) {
+    int depth = 0, quoted = 0;
+    for (char *p = piece; *p; ++p) {
+        if (nested_at(piece, p, &depth, &quoted)) continue;
+        if (*p == '|') return p;
+    }
+    return NULL;
+}
+
+/* Could a command of the loop body read the loop's stdin itself? Pieces the
+   shell runs itself (read, echo, assignments, ...) and pieces with their own '<'
+   cannot; anything else is assumed to. */
+int body_shares_stdin(char *body) {
+    static const char *in_shell[] = { "read", "echo", "cd", "history", "jobs", "mux", "profile", "exit", "cp", NULL };
+    int n, *types;
+    char **pieces = split_by_separators(body, &n, &types);
+    for (int i = 0; i < n; ++i) {
+        char *pc = pieces[i];
+        if (*pc == '\0' || (var_name_len(pc) && pc[var_name_len(pc)] == '=')) continue;
+        if (find_top_pipe(pc) || kw_at(pc, pc, "while")) return 1;
+        if (strchr(pc, '<')) continue;
+        size_t w = strcspn(pc, " \t");
+        if (w == 3 && strncmp(pc, "cat", 3) == 0 && pc[w] != '\0') continue;   // cat with file arguments
+        int found = 0;
+        for (int k = 0; in_shell[k]; ++k) {
+            if (strlen(in_shell[k]) == w && strncmp(pc, in_shell[k], w) == 0) found = 1;
+        }
+        if (!found) return 1;
+    }
+    return 0;
+}
+
+/* Copy [from, to) with surrounding blanks and a trailing ';' removed */
+char *loop_part(const char *from, const char *to) {
+    while (from < to && isspace((unsigned char)*from)) from++;
+    while (to > from && (isspace((unsigned char)to[-1]) || to[-1] == ';')) to--;
+    return line_strndup(from, to - from);
+}
+
+int run_while(char *text) {
+    PROF_FUNC;
+    char *cond_end = NULL, *body = NULL, *body_end = NULL;
+    int depth = 0, quoted = 0;
+    for (char *p = text + 5; *p; ++p) {
+        if (*p == '"') quoted = !quoted;
+        if (quoted) continue;
+        if (kw_at(text, p, "while")) depth++;
+        else if (kw_at(text, p, "done") && depth-- == 0) { body_end = p; break; }
+        else if (depth == 0 && !body && kw_at(text, p, "do")) { cond_end = p; body = p + 2; }
+    }
+    if (!body || !body_end) {
+        fprintf(stderr, "Invalid Command\n");
+        return 1;
+    }
+    char *cond = loop_part(text + 5, cond_end);
+    char *list = loop_part(body, body_end);
+    if (*cond == '\0' || *list == '\0') {
+        fprintf(stderr, "Invalid Command\n");
+        return 1;
+    }
+
+    // 'done < in > out': redirect the shell's own fds for the loop
+    char *redir[MAXARGS + 1];
+    int nredir = tokenize_args(expand_vars(body_end + 4), redir);
+    int fds[2] = { -1, -1 };
+    for (int i = 0; i < nredir; i += 2) {
+        int out = redir[i][0] == '>';
+        int flags = !out ? O_RDONLY : O_WRONLY | O_CREAT | (redir[i][1] == '>' ? O_APPEND : O_TRUNC);
+        if (i + 1 >= nredir || (strcmp(redir[i], "<") && strcmp(redir[i], ">") && strcmp(redir[i], ">>"))) {
+            fprintf(stderr, "Invalid Command\n");
+            return 1;
+        }
+        if (fds[out] >= 0) close(fds[out]);
+        fds[out] = open(unquoted(redir[i + 1]), flags | O_CLOEXEC, 0644);
+        if (fds[out] < 0) {
+            perror("Invalid Command");
+            if (fds[!out] >= 0) close(fds[!out]);
+            return 1;
+        }
+    }
+    rd_sync();
+    fflush(stdout);
+    struct fd_save fs;
+    fd_redirect(&fs, fds[0], fds[1]);
+    for (int k = 0; k < 2; ++k)
+        if (fds[k] >= 0) close(fds[k]);
+    // a redirected fd 0 gets its own read-ahead buffer
+    struct rd_buf *outer = rd_in, *loop_rd = NULL;
+    if (fs.saved[0] >= 0) {
+        loop_rd = malloc(sizeof(*loop_rd));
+        rd_init(loop_rd, STDIN_FILENO);
+        rd_in = loop_rd;
+    }
+    int outer_shared = rd_in->shared;
+    if (body_shares_stdin(list)) rd_in->shared = 1;
+
+    int status = 0;
+    int outer_final = final_list;
+    final_list = 0;     // nothing inside a loop is ever the last command
+    struct arena_mark m = arena_mark(&line_arena);
+    while (run_list(cond) == 0) {
+        status = run_list(list);
+        arena_rewind(&line_arena, m);
+    }
+    arena_rewind(&line_arena, m);
+    final_list = outer_final;
+
+    rd_in->shared = outer_shared;
+    free(loop_rd);
+    rd_in = outer;
+    fflush(stdout);
+    fd_restore(&fs);
+    return status;
+}
+
+/* ---- ( list ) subshells ----
+   The list runs in a forked copy of the shell, so cd and assignments inside
+   stay there; its last command is exec'd in that copy (see run_script).
+   The common '( cd dir && cmd )' shape needs no copy of the shell at all: cmd
+   is spawned directly with a chdir file action, and its redirections are
+   opened by file actions after the chdir, i.e. relative to dir.
+*/
+
+/* Spawn 'cd dir && cmd' as one process; -1 if cmd needs the general path */
+int spawn_in_dir(char *dir, char *cmd) {
+    if (perfstat_active || *cmd == '(' || find_top_pipe(cmd) || kw_at(cmd, cmd, "while")
+        || (var_name_len(cmd) && cmd[var_name_len(cmd)] == '=')) return -1;
+    char *tok[MAXARGS + 1];
+    int ntok = tokenize_args(expand_vars(cmd), tok);
+    char *args[MAXARGS + 1];
+    int nargs = 0;
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addchdir_np(&fa, unquoted(dir));
+    int has_in = 0, has_out = 0, ok = 1;
+    for (int i = 0; i < ntok && ok; ++i) {
+        if (strcmp(tok[i], "<") && strcmp(tok[i], ">") && strcmp(tok[i], ">>")) {
+            // words are globbed relative to dir, which only the general path can do
+            if (tok[i][0] != QUOTED_MARK && strpbrk(tok[i], "*?[{")) ok = 0;
+            args[nargs++] = (char *)unquoted(tok[i]);
+            continue;
+        }
+        if (i + 1 >= ntok) ok = 0;
+        else if (tok[i][0] == '<') {
+            posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, unquoted(tok[++i]), O_RDONLY, 0);
+            has_in = 1;
+        } else {
+            int flags = O_WRONLY | O_CREAT | (tok[i][1] == '>' ? O_APPEND : O_TRUNC);
+            posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, unquoted(tok[++i]), flags, 0644);
+            has_out = 1;
+        }
+    }
+    args[nargs] = NULL;
+    if (nargs > 0 && is_shell_builtin(args[0])) ok = 0;
+    if (!ok || nargs == 0) {
+        posix_spawn_file_actions_destroy(&fa);
+        return -1;
+    }
+
+    if (access(unquoted(dir), X_OK) != 0) {
+        // report a bad dir like cd does, not as a failed exec
+        perror("Invalid Command");
+        posix_spawn_file_actions_destroy(&fa);
+        return 1;
+    }
+    struct audit_start as;
+    audit_begin(&as);
+    if (launch_background && !has_in) posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    if (launch_background && !has_out) mux_open();
+    if (mux_pending) posix_spawn_file_actions_adddup2(&fa, mux_pending->wfd, STDOUT_FILENO);
+    rd_sync();
+    fflush(stdout);
+    pid_t pid;
+    int err = posix_spawnp(&pid, args[0], &fa, NULL, args, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    if (err != 0) {
+        // chdir, open or exec failed in the child
+        errno = err;
+        perror("Invalid Command");
+        mux_abandon();
+        job_nstages = 0;
+        return err == ENOENT || err == EACCES ? 127 : 1;
+    }
+    job_stages[0].pid = pid;
+    job_nstages = 1;
+    int status;
+    if (launch_background) {
+        job_stages[0].status = -1;
+        status = 0;
+    } else {
+        wait4(pid, &status, 0, &job_stages[0].ru);
+        clock_gettime(CLOCK_MONOTONIC, &job_stages[0].end);
+        job_stages[0].status = status;
+        status = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+    }
+    audit_command(&as, args, -1, -1, 0, 0, 1, status);
+    return status;
+}
+
+/* In a forked copy of the shell: run list as a script would, then exit */
+void run_forked_list(char *list) {
+    launch_background = 0;
+    mux_mode = MUX_OFF;
+    rd_in = &stdin_rd;
+    rd_init(rd_in, STDIN_FILENO);
+    final_list = 1;
+    audit_after_fork();
+    int st = run_list(list);
+    fflush(stdout);
+    audit_shutdown();
+    _exit(st);
+}
+
+int run_subshell(char *piece) {
+    PROF_FUNC;
+    int depth = 0, quoted = 0;
+    char *rparen = NULL;
+    for (char *p = piece; *p && !rparen; ++p)
+        if (!nested_at(piece, p, &depth, &quoted) && *p == ')') rparen = p;
+    if (!rparen || *trim(rparen + 1) != '\0') {
+        fprintf(stderr, "Invalid Command\n");
+        return 1;
+    }
+    char *list = trim(line_strndup(piece + 1, rparen - piece - 1));
+    job_nstages = 0;
+
+    int n, *types;
+    char **pieces = split_by_separators(list, &n, &types);
+    if (n == 2 && types[0] == 1 && strncmp(pieces[0], "cd", 2) == 0 && isspace((unsigned char)pieces[0][2])) {
+        char *cd[MAXARGS + 1];
+        if (tokenize_args(expand_vars(pieces[0]), cd) == 2) {
+            int status = spawn_in_dir(cd[1], pieces[1]);
+            if (status >= 0) return status;
+        }
+    }
+
+    rd_sync();
+    fflush(stdout);
+    if (launch_background) mux_open();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Invalid Command");
+        mux_abandon();
+        return 1;
+    }
+    if (pid == 0) {
+        if (launch_background) stdin_from_devnull();
+        if (mux_pending) dup2(mux_pending->wfd, STDOUT_FILENO);
+        run_forked_list(list);
+    }
+    job_stages[0].pid = pid;
+    job_nstages = 1;
+    if (launch_background) {
+        job_stages[0].status = -1;
+        return 0;
+    }
+    int status;
+    wait4(pid, &status, 0, &job_stages[0].ru);
+    clock_gettime(CLOCK_MONOTONIC, &job_stages[0].end);
+    job_stages[0].status = status;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+/* ---- process substitution: <(list) and >(list) ----
+   Each list runs in a forked copy of the shell on one end of a pipe; the
+   word is replaced by /dev/fd/N for the shell's end, which the command
+   inherits (or, for builtins, opens in the shell). The pipe ends are
+   close-on-exec until every list has been started, and each list closes
+   every end but the one on its stdin or stdout, so no list holds its own or
+   another's pipe open. Once the command is done the shell closes its ends,
+   which gives >(list) its EOF, and waits for the lists; those of a '&'
+   command are reaped along with the jobs instead.
+*/
+#define PROCSUB_MAX 16
+
+static int procsub_fds[PROCSUB_MAX];
+static int procsub_nfds = 0;
+static pid_t procsub_pids[64];      // started and not yet reaped
+static int procsub_npids = 0;
+
+/* Does the piece contain <( or >( at the start of a word, outside quotes? */
+int procsub_at(const char *piece) {
+    int quoted = 0;
+    for (const char *p = piece; *p; ++p) {
+        if (*p == '"') quoted = !quoted;
+        if (!quoted && (*p == '<' || *p == '>') && p[1] == '(' && (p == piece || isspace((unsigned char)p[-1])))
+            return 1;
+    }
+    return 0;
+}
+
+/* Start the substituted lists of *piece and rewrite it with /dev/fd paths */
+int procsub_start(char **piece) {
+    PROF_FUNC;
+    char *s = *piece;
+    char *out = line_alloc(strlen(s) + PROCSUB_MAX * 16 + 1);
+    size_t n = 0;
+    int quoted = 0;
+    rd_sync();
+    fflush(stdout);
+    while (*s) {
+        if (*s == '"') quoted = !quoted;
+        if (quoted || !(*s == '<' || *s == '>') || s[1] != '(' || (s > *piece && !isspace((unsigned char)s[-1]))) {
+            out[n++] = *s++;
+            continue;
+        }
+        int writes = (*s == '>');   // >(list): the command writes, the list reads
+        int depth = 0, q = 0;
+        char *rparen = NULL;
+        for (char *p = s + 1; *p && !rparen; ++p)
+            if (!nested_at(s + 1, p, &depth, &q) && *p == ')') rparen = p;
+        int fds[2];
+        if (!rparen || procsub_nfds >= PROCSUB_MAX || procsub_npids >= 64 || pipe2(fds, O_CLOEXEC) != 0) {
+            fprintf(stderr, "Invalid Command\n");
+            return -1;
+        }
+        char *list = trim(line_strndup(s + 2, rparen - s - 2));
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("Invalid Command");
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
+        if (pid == 0) {
+            dup2(fds[writes ? 0 : 1], writes ? STDIN_FILENO : STDOUT_FILENO);
+            // the list is a fork, not an exec: drop every pipe end but its own
+            close(fds[0]);
+            close(fds[1]);
+            for (int i = 0; i < procsub_nfds; ++i) close(procsub_fds[i]);
+            if (launch_background && !writes) stdin_from_devnull();
+            run_forked_list(list);
+        }
+        close(fds[writes ? 0 : 1]);
+        procsub_fds[procsub_nfds++] = fds[writes];
+        procsub_pids[procsub_npids++] = pid;
+        n += sprintf(out + n, "/dev/fd/%d", fds[writes]);
+        s = rparen + 1;
+    }
+    out[n] = '\0';
+    // only now may the command inherit them
+    for (int i = 0; i < procsub_nfds; ++i) fcntl(procsub_fds[i], F_SETFD, 0);
+    *piece = out;
+    return 0;
 }
 
-/* Split a line by separators ; and && while keeping their types.
+/* Close the shell's pipe ends; wait for the lists unless the command went to the background */
+void procsub_finish(void) {
+    for (int i = 0; i < procsub_nfds; ++i) close(procsub_fds[i]);
+    procsub_nfds = 0;
+    if (launch_background) return;
+    for (int i = 0; i < procsub_npids; ++i) waitpid(procsub_pids[i], NULL, 0);
+    procsub_npids = 0;
+}
+
+/* Reap the lists of finished background commands */
+void procsub_reap(void) {
+    int k = 0;
+    for (int i = 0; i < procsub_npids; ++i)
+        if (waitpid(procsub_pids[i], NULL, WNOHANG) == 0) procsub_pids[k++] = procsub_pids[i];
+    procsub_npids = k;
+}
+
+/* Split a line by separators ;, && and & while keeping their types.
    Returns arrays: commands[] and separators[] where separators[i] is:
       0 => ';' or end
       1 => '&&'
+      2 => '&' (run the piece in the background)
    The number of commands returned is stored in *count.
 */
 char **split_by_separators(char *line, int *count, int **sep_types) {
+    PROF_FUNC;
     // We'll scan and split
     char *s = line;
     int cap = 16;
-    char **cmds = malloc(sizeof(char*)*cap);
-    int *types = malloc(sizeof(int)*cap);
+    char **cmds = line_alloc(sizeof(char*)*cap);
+    int *types = line_alloc(sizeof(int)*cap);
     int c = 0;
 
     while (*s) {
-        // find next separator ; or &&
+        // find next separator ; or && (not inside a while loop or quotes)
         char *p = s;
         char *next_sep = NULL;
         int sep_type = 0;
+        int depth = 0, quoted = 0;
         while (*p) {
+            if (nested_at(line, p, &depth, &quoted)) { p++; continue; }
             if (p[0] == ';') { next_sep = p; sep_type = 0; break; }
             if (p[0] == '&' && p[1] == '&') { next_sep = p; sep_type = 1; break; }
+            if (p[0] == '&') { next_sep = p; sep_type = 2; break; }
             p++;
         }
         if (next_sep) {
             int len = next_sep - s;
-            char *piece = malloc(len+1);
-            strncpy(piece, s, len);
-            piece[len] = '\0';
-            cmds[c] = trim(piece);
+            cmds[c] = trim(line_strndup(s, len));
             types[c] = sep_type;
             c++;
             if (c >= cap) {
+                cmds = arena_realloc(&line_arena, cmds, sizeof(char*)*cap, sizeof(char*)*cap*2);
+                types = arena_realloc(&line_arena, types, sizeof(int)*cap, sizeof(int)*cap*2);
                 cap *= 2;
-                cmds = realloc(cmds, sizeof(char*)*cap);
-                types = realloc(types, sizeof(int)*cap);
             }
             if (sep_type == 1) s = next_sep + 2;
             else s = next_sep + 1;
             while (*s && isspace((unsigned char)*s)) s++;
         } else {
             // last piece
-            char *piece = strdup(s);
-            cmds[c] = trim(piece);
+            cmds[c] = trim(line_strdup(s));
             types[c] = 0;
             c++;
             break;
@@ -464,60 +6444,79 @@ char **split_by_separators(char *line, int *count, int **sep_types) {
     return cmds;
 }
 
-/* Free results from split_by_separators */
-void free_split(char **cmds, int count, int *types) {
-    for (int i = 0; i < count; ++i) free(cmds[i]);
-    free(cmds);
-    free(types);
-}
-
 /* Process a single command piece (may contain a pipe) and execute. Returns exit status. */
 int process_piece(char *piece) {
+    PROF_FUNC;
+    if (kw_at(piece, piece, "while")) return run_while(piece);
+    if (*piece == '(') {
+        int status = run_subshell(piece);
+        if (launch_background && job_nstages > 0) printf("[%d] %d\n", job_add(piece), (int)job_stages[0].pid);
+        return status;
+    }
+    // 'perfstat <job>': count the job's children
+    if (strncmp(piece, "perfstat", 8) == 0 && (piece[8] == '\0' || isspace((unsigned char)piece[8]))) {
+        char *job = trim(piece + 8);
+        if (*job == '\0' || perfstat_active) {
+            fprintf(stderr, "Invalid Command\n");
+            return 1;
+        }
+        return run_perfstat(job);
+    }
+    if (var_name_len(piece) && piece[var_name_len(piece)] == '=' && var_assign(expand_vars(piece))) return 0;
+    if (procsub_at(piece)) {
+        job_label = piece;
+        int status = procsub_start(&piece) == 0 ? process_piece(piece) : 1;
+        job_label = NULL;
+        procsub_finish();
+        return status;
+    }
+    struct audit_start as;
+    audit_begin(&as);
     // Check for pipe '|'. Only single pipe supported.
-    char *pipe_pos = strchr(piece, '|');
+    char *pipe_pos = find_top_pipe(piece);
     if (pipe_pos) {
-        // left and right
-        char *left = strndup(piece, pipe_pos - piece);
-        char *right = strdup(pipe_pos + 1);
-        left = trim(left); right = trim(right);
+        // left and right; a while loop on the right is run by a forked shell
+        char *left_buf = line_strndup(piece, pipe_pos - piece);
+        char *right_buf = line_strdup(pipe_pos + 1);
+        char *left = expand_vars(trim(left_buf)), *right = trim(right_buf);
+        char *right_loop = kw_at(right, right, "while") ? right : NULL;
+        if (!right_loop) right = expand_vars(right);
 
         // parse redirection and build args for left and right (redirection not allowed with pipes per assumptions of assignment)
         char **left_argv; int left_argc;
         int in_fd_left, out_fd_left, append_left;
         if (parse_redirection_and_build_args(left, &left_argv, &left_argc, &in_fd_left, &out_fd_left, &append_left) != 0) {
             // error in parsing
-            free(left); free(right);
             return 1;
         }
         char **right_argv; int right_argc;
-        int in_fd_right, out_fd_right, append_right;
-        if (parse_redirection_and_build_args(right, &right_argv, &right_argc, &in_fd_right, &out_fd_right, &append_right) != 0) {
+        int in_fd_right = -1, out_fd_right = -1, append_right;
+        char *loop_argv[] = { "while", NULL };
+        if (right_loop) {
+            right_argv = loop_argv;
+            right_argc = 1;
+        } else if (parse_redirection_and_build_args(right, &right_argv, &right_argc, &in_fd_right, &out_fd_right, &append_right) != 0) {
             // error
-            free(left); free(right);
-            free_expanded(left_argv, left_argc);
             return 1;
         }
 
         // We won't support redirection combined with pipe to simplify: if any redirection fds present, error
         if (in_fd_left >= 0 || out_fd_left >= 0 || in_fd_right >= 0 || out_fd_right >= 0) {
             fprintf(stderr, "Invalid Command\n");
-            free(left); free(right);
-            free_expanded(left_argv, left_argc);
-            free_expanded(right_argv, right_argc);
             return 1;
         }
 
         // execute pipe
-        int status = execute_pipe(left_argv, left_argc, right_argv, right_argc);
-
-        free(left); free(right);
-        free_expanded(left_argv, left_argc);
-        free_expanded(right_argv, right_argc);
+        int status = execute_pipe(left_argv, left_argc, right_argv, right_argc, right_loop);
+        audit_command(&as, left_argv, -1, -1, 0, 0, 2, status);
+        audit_command(&as, right_argv, -1, -1, 0, 1, 2, status);
+        if (launch_background && job_nstages > 0) printf("[%d] %d\n", job_add(piece), (int)job_stages[1].pid);
         return status;
     } else {
         // no pipe -> possibly redirection
         char **argv; int argc;
         int in_fd, out_fd, append_flag;
+        piece = expand_vars(piece);
         int pr = parse_redirection_and_build_args(piece, &argv, &argc, &in_fd, &out_fd, &append_flag);
         if (pr == -1) {
             fprintf(stderr, "Invalid Command\n");
@@ -527,59 +6526,285 @@ int process_piece(char *piece) {
             return 1;
         }
         int status = execute_command(argv, argc, in_fd, out_fd, append_flag);
+        audit_command(&as, argv, in_fd, out_fd, append_flag, 0, 1, status);
+        if (launch_background && job_nstages > 0) printf("[%d] %d\n", job_add(piece), (int)job_stages[0].pid);
 
         if (in_fd >= 0) close(in_fd);
         if (out_fd >= 0) close(out_fd);
-        free_expanded(argv, argc);
         return status;
     }
 }
 
-int main(int argc, char **argv) {
-    while (1) {
-        char *line = read_line_with_tab();
-        if (!line) break;
-        char *trimline = trim(line);
-        if (strlen(trimline) == 0) { free(line); continue; }
+/* Run a command list: pieces separated by ;, && and &. Returns the last status. */
+int run_list(char *line) {
+    PROF_FUNC;
+    // Split by separators ; and &&
+    int piece_count;
+    int *sep_types;
+    char **pieces = split_by_separators(line, &piece_count, &sep_types);
+    return run_pieces(pieces, sep_types, piece_count);
+}
 
-        // Add to history (save original)
-        add_history(trimline);
+/* Run pieces already split by split_by_separators */
+int run_pieces(char **pieces, int *sep_types, int piece_count) {
+    for (int i = 0; i < piece_count; ++i) {
+        char *piece = pieces[i];
+        if (strlen(piece) == 0) {
+            last_status = 0;
+            continue;
+        }
 
-        // Split by separators ; and &&
-        int piece_count;
-        int *sep_types;
-        char **pieces = split_by_separators(trimline, &piece_count, &sep_types);
+        // process piece ('&' pieces are started in the background)
+        launch_background = (sep_types[i] == 2);
+        exec_in_place = final_list && i == piece_count - 1;
+        last_status = process_piece(piece);
+        launch_background = exec_in_place = 0;
 
-        int last_status = 0;
-        for (int i = 0; i < piece_count; ++i) {
-            char *piece = pieces[i];
-            if (strlen(piece) == 0) {
-                last_status = 0;
-                continue;
+        // Implement semantics: if the separator after this piece is '&&' and last_status != 0 then skip next piece(s) until after that chain
+        if (i < piece_count-1 && sep_types[i] == 1 && last_status != 0) {
+            // skip next piece
+            i++;
+            // continue skipping chained && sequences where previous failed
+            while (i < piece_count-1 && sep_types[i] == 1) {
+                i++;
             }
+        }
+    }
+    return last_status;
+}
 
-            // process piece
-            last_status = process_piece(piece);
+/* ---- mtlsh -c 'list', mtlsh script and 'source script' ----
+   Non-interactive input runs without prompt, history or line editing. The
+   last simple command of a -c string or of a script's last line is exec'd
+   in the shell process itself when nothing is left to do afterwards, saving
+   a fork and a wait per invocation.
 
-            // if next separator is && and last_status non-zero -> skip until next separator
-            if (i+1 < piece_count && sep_types[i+1] == 1) {
-                // sep_types index i corresponds to this piece's separator? Our split placed types[i] for this piece.
-                // We used types[i] as the separator following the ith piece. So check types[i] (not i+1).
-            }
+   A script is compiled once into its command pieces, already split on ; &&
+   and & (the loop- and quote-aware scan every typed line goes through), and
+   run from that image. The image is cached in $XDG_CACHE_HOME/mtlsh (or
+   ~/.cache/mtlsh) under a hash of the script's real path. A later run that
+   finds the script's mtime and size unchanged maps the cache file and runs
+   it without reading the script at all; if only the mtime moved, the content
+   hash decides. MTL458_SCRIPT_CACHE=0 compiles in memory every time.
+*/
+#define SC_MAGIC "MTLSC02"
 
-            // Implement semantics: if the separator after this piece is '&&' and last_status != 0 then skip next piece(s) until after that chain
-            if (i < piece_count-1 && sep_types[i] == 1 && last_status != 0) {
-                // skip next piece
-                i++;
-                // continue skipping chained && sequences where previous failed
-                while (i < piece_count-1 && sep_types[i] == 1) {
-                    i++;
-                }
-            }
+struct sc_header {
+    char magic[8];
+    uint64_t hash;          // FNV-1a of the script text
+    int64_t mtime_ns;
+    uint64_t size;
+    uint64_t len;           // bytes of piece records after the header
+};
+
+struct sc_piece {
+    uint32_t len;           // text bytes, without the NUL
+    uint8_t sep;            // separator after the piece, as split_by_separators
+    uint8_t eol;            // last piece of its line
+    uint16_t pad;
+    char text[];            // NUL-terminated; records are padded to 4 bytes
+};
+
+struct script_image {
+    char *base;             // header, then the records
+    size_t maplen;          // > 0: base is a mapping of the cache file
+};
+
+#define SC_NEXT(r) ((struct sc_piece *)((char *)(r) + ((sizeof(struct sc_piece) + (r)->len + 1 + 3) & ~(size_t)3)))
+
+/* Cache file of a script, creating the cache directory; -1 if there is none */
+int sc_cache_path(const char *script, char *out, size_t n) {
+    const char *env = getenv("MTL458_SCRIPT_CACHE");
+    if (env && strcmp(env, "0") == 0) return -1;
+    char real[PATH_MAX], dir[PATH_MAX];
+    if (!realpath(script, real) || cache_dir(dir, sizeof(dir)) != 0) return -1;
+    snprintf(out, n, "%s/%016llx", dir, (unsigned long long)fnv1a(real, strlen(real)));
+    return 0;
+}
+
+/* Append the piece records of a script text to sb */
+void sc_compile(const char *text, size_t n, struct sbuf *sb) {
+    PROF_FUNC;
+    const char *end = text + n;
+    while (text < end) {
+        const char *nl = memchr(text, '\n', end - text);
+        if (!nl) nl = end;
+        struct arena_mark m = arena_mark(&line_arena);
+        char *line = trim(line_strndup(text, nl - text));
+        text = nl + 1;
+        if (*line == '\0' || *line == '#') {
+            arena_rewind(&line_arena, m);
+            continue;
+        }
+        int count, *types;
+        char **pieces = split_by_separators(line, &count, &types);
+        for (int i = 0; i < count; ++i) {
+            struct sc_piece r = { .len = (uint32_t)strlen(pieces[i]), .sep = (uint8_t)types[i],
+                                  .eol = i == count - 1, .pad = 0 };
+            static const char pad[4];
+            sb_put(sb, (const char *)&r, sizeof(r));
+            sb_put(sb, pieces[i], r.len);
+            sb_put(sb, pad, ((sizeof(r) + r.len + 1 + 3) & ~(size_t)3) - sizeof(r) - r.len);
+        }
+        arena_rewind(&line_arena, m);
+    }
+}
+
+/* Compile a script or map its cached image; -1 if it cannot be read */
+int script_load(const char *path, struct script_image *img) {
+    PROF_FUNC;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("Invalid Command");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    int64_t mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    char cpath[PATH_MAX];
+    int cached = sc_cache_path(path, cpath, sizeof(cpath)) == 0;
+    int cfd = cached ? open(cpath, O_RDWR | O_CLOEXEC) : -1;
+    struct sc_header *h = NULL;
+    struct stat cst;
+    if (cfd >= 0 && fstat(cfd, &cst) == 0 && cst.st_size >= (off_t)sizeof(*h)) {
+        void *map = mmap(NULL, cst.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, cfd, 0);
+        h = map == MAP_FAILED ? NULL : map;
+        if (h && (memcmp(h->magic, SC_MAGIC, 8) != 0 || h->len != cst.st_size - sizeof(*h) || h->size != (uint64_t)st.st_size)) {
+            munmap(h, cst.st_size);
+            h = NULL;
+        }
+        if (h && h->mtime_ns == mtime) {
+            close(cfd);
+            close(fd);
+            img->base = (char *)h;
+            img->maplen = cst.st_size;
+            return 0;
         }
+    }
+
+    char *text = malloc(st.st_size + 1);
+    size_t n = 0;
+    ssize_t r;
+    while (n < (size_t)st.st_size && (r = read(fd, text + n, st.st_size - n)) > 0) n += r;
+    close(fd);
+    uint64_t hash = fnv1a(text, n);
+    if (h && h->hash == hash && n == h->size) {
+        // touched, not changed: keep the image, remember the new mtime
+        if (pwrite(cfd, &mtime, sizeof(mtime), offsetof(struct sc_header, mtime_ns)) < 0) {}
+        close(cfd);
+        free(text);
+        img->base = (char *)h;
+        img->maplen = cst.st_size;
+        return 0;
+    }
+    if (h) munmap(h, cst.st_size);
+    if (cfd >= 0) close(cfd);
 
-        free_split(pieces, piece_count, sep_types);
-        free(line);
+    struct sc_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SC_MAGIC, 8);
+    hdr.hash = hash;
+    hdr.mtime_ns = mtime;
+    hdr.size = n;
+    struct sbuf sb = { NULL, 0, 0 };
+    sb_put(&sb, (const char *)&hdr, sizeof(hdr));
+    sc_compile(text, n, &sb);
+    free(text);
+    ((struct sc_header *)sb.buf)->len = sb.len - sizeof(hdr);
+    if (cached) {
+        // write a new file and rename it over the old one: a reader never sees half an image
+        char tmp[PATH_MAX + 16];
+        snprintf(tmp, sizeof(tmp), "%s.%d", cpath, (int)getpid());
+        int tfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (tfd >= 0) {
+            int ok = write(tfd, sb.buf, sb.len) == (ssize_t)sb.len;
+            close(tfd);
+            if (!ok || rename(tmp, cpath) != 0) unlink(tmp);
+        }
     }
+    img->base = sb.buf;
+    img->maplen = 0;
     return 0;
 }
+
+void script_unload(struct script_image *img) {
+    if (img->maplen) munmap(img->base, img->maplen);
+    else free(img->base);
+}
+
+/* Run a script image line by line; top: the script is all the shell has to do */
+int script_run(struct script_image *img, int top) {
+    PROF_FUNC;
+    struct sc_header *h = (struct sc_header *)img->base;
+    struct sc_piece *r = (struct sc_piece *)(h + 1), *end = (struct sc_piece *)((char *)(h + 1) + h->len);
+    int outer_final = final_list;
+    while (r < end) {
+        struct arena_mark m = arena_mark(&line_arena);
+        int n = 0;
+        struct sc_piece *q = r;
+        while (q < end) {
+            n++;
+            int eol = q->eol;
+            q = SC_NEXT(q);
+            if (eol) break;
+        }
+        char **pieces = line_alloc(sizeof(char *) * n);
+        int *types = line_alloc(sizeof(int) * n);
+        for (int i = 0; i < n; ++i, r = SC_NEXT(r)) {
+            pieces[i] = r->text;
+            types[i] = r->sep;
+        }
+        if (top) jobs_notify();
+        final_list = top && r >= end;
+        run_pieces(pieces, types, n);
+        arena_rewind(&line_arena, m);
+    }
+    final_list = outer_final;
+    return last_status;
+}
+
+int run_script(const char *path) {
+    struct script_image img;
+    if (script_load(path, &img) != 0) return 127;
+    int status = script_run(&img, 1);
+    script_unload(&img);
+    return status;
+}
+
+/* 'source path': run a script in this shell, so its cd and variables stay */
+int source_script(const char *path) {
+    struct script_image img;
+    if (script_load(path, &img) != 0) return 1;
+    int status = script_run(&img, 0);
+    script_unload(&img);
+    return status;
+}
+
+int main(int argc, char **argv) {
+    PROF_FUNC;
+    audit_init();
+    if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+        final_list = 1;
+        return run_list(line_strdup(argv[2]));
+    }
+    if (argc > 1) return run_script(argv[1]);
+    while (1) {
+        jobs_notify();
+        char *line = read_line_with_tab();
+        if (!line) break;
+        char *trimline = trim(line);
+        if (strlen(trimline) == 0) { arena_reset(&line_arena); continue; }
+
+        // Add to history (save original)
+        add_history(trimline);
+
+        run_list(trimline);
+
+#ifdef MTL458_ALLOC_STATS
+        alloc_stats_line();
+#endif
+        // everything the line allocated goes in one step
+        arena_reset(&line_arena);
+    }
+    return last_status;
+}